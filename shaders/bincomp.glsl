@@ -0,0 +1,104 @@
+#version 430
+
+// Bins the spheres and boxes into a list for each tile of the ray target, of the ones that the primary
+// rays of the tile could possibly hit. The bounding box of each primitive is projected onto the ray
+// target the same way the primary rays are shot, and the primitive is added to the list of every tile
+// that the projection touches. Each tile has room for 'tileCapacity' primitives, which are allocated
+// with an atomic counter per tile. Primitives that reach behind the camera go in every list.
+
+layout(local_size_x = 64) in;
+
+layout(location = 0) uniform vec2 resolution;
+layout(location = 1) uniform float foveaDist;
+layout(location = 2) uniform vec3 cameraPos;
+layout(location = 3) uniform mat3 invView;
+layout(location = 12) uniform vec2 targetSize;
+layout(location = 13) uniform uint tileSize;
+layout(location = 14) uniform uint tileCapacity;
+
+struct Sphere {
+	vec3 pos;
+	float radius;
+	uint material;
+};
+
+struct Box {
+	ivec3 pos;
+	uint material; // Material index in the low 16 bits, and a bit for each face with any voxel face exposed above that.
+	ivec3 size;
+	uint irradianceOffset;
+};
+
+layout(std430, binding=3) readonly buffer SPHERES {
+	Sphere spheres[];
+};
+layout(std430, binding=4) readonly buffer BOXES {
+	Box boxes[];
+};
+layout(std430, binding=17) buffer TILE_PRIMITIVES {
+	uint tilePrimitives[]; // The number of primitives in each tile, and then the primitive IDs of each tile.
+};
+
+// Same as in the ray tracing shader.
+const uint sphereType = 2;
+const uint voxelType = 3;
+const float nearDist = 0.01;
+
+// Add a primitive to the list of a tile. The count keeps going past the capacity, so that the
+// tiles that ran out of room can be told apart.
+void addToTile(uint numTiles, uint tile, uint primitive) {
+	uint slot = atomicAdd(tilePrimitives[tile], 1u);
+	if (slot < tileCapacity)
+		tilePrimitives[numTiles + tile * tileCapacity + slot] = primitive;
+}
+
+void main() {
+	uint i = gl_GlobalInvocationID.x;
+	uint numSpheres = spheres.length();
+	if (i >= numSpheres + boxes.length())
+		return;
+
+	vec3 boundsMin, boundsMax;
+	uint primitive;
+	if (i < numSpheres) {
+		Sphere sphere = spheres[i];
+		boundsMin = sphere.pos - sphere.radius;
+		boundsMax = sphere.pos + sphere.radius;
+		primitive = (sphereType << 28) | i;
+	} else {
+		Box box = boxes[i - numSpheres];
+		boundsMin = vec3(box.pos);
+		boundsMax = vec3(box.pos + box.size);
+		primitive = (voxelType << 28) | (i - numSpheres);
+	}
+
+	// Find the pixels that the corners of the bounds are at, which undoes 'getPrimaryRay'.
+	vec2 aspect = vec2(
+		max(resolution.x / resolution.y, 1),
+		max(resolution.y / resolution.x, 1));
+	mat3 view = transpose(invView);
+	vec2 pixelMin = vec2(1e30);
+	vec2 pixelMax = vec2(-1e30);
+	bool behind = false;
+	for (uint c = 0; c < 8 && !behind; ++c) {
+		vec3 corner = mix(boundsMin, boundsMax, vec3(c & 1u, (c >> 1) & 1u, c >> 2));
+		vec3 v = view * (corner - cameraPos);
+		behind = v.z > -nearDist;
+		vec2 ndc = v.xy * abs(foveaDist) / (aspect * -v.z);
+		vec2 pixel = (ndc + 1) * 0.5 * targetSize - 0.5;
+		pixelMin = min(pixelMin, pixel);
+		pixelMax = max(pixelMax, pixel);
+	}
+
+	// Leave a pixel of room around the projection for the jittered rays.
+	uvec2 numTiles = (uvec2(targetSize) + tileSize - 1) / tileSize;
+	ivec2 tileMin = ivec2(0);
+	ivec2 tileMax = ivec2(numTiles) - 1;
+	if (!behind) {
+		tileMin = ivec2(floor(clamp((pixelMin - 1) / tileSize, vec2(0), vec2(numTiles))));
+		tileMax = ivec2(floor(clamp((pixelMax + 1) / tileSize, vec2(-1), vec2(numTiles - 1))));
+	}
+	for (int y = tileMin.y; y <= tileMax.y; ++y)
+		for (int x = tileMin.x; x <= tileMax.x; ++x)
+			addToTile(numTiles.x * numTiles.y, uint(y) * numTiles.x + uint(x), primitive);
+}
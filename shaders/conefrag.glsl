@@ -0,0 +1,130 @@
+#version 430
+
+// Traces one cone for each tile of the ray target that contains all of the primary rays of
+// the tile, and outputs how far every one of those rays can safely travel before it could
+// possibly hit anything. The primary rays then start from there instead of from the camera.
+
+layout(location = 0) out float outFragDist;
+
+layout(location = 0) uniform vec2 resolution;
+layout(location = 1) uniform float foveaDist;
+layout(location = 2) uniform vec3 cameraPos;
+layout(location = 3) uniform mat3 invView;
+layout(location = 12) uniform vec2 targetSize;
+layout(location = 13) uniform uint tileSize;
+
+struct Plane {
+	vec3 normal;
+	vec3 pos;
+	uint material;
+};
+
+struct Sphere {
+	vec3 pos;
+	float radius;
+	uint material;
+};
+
+struct Box {
+	ivec3 pos;
+	uint material; // Material index in the low 16 bits, and a bit for each face with any voxel face exposed above that.
+	ivec3 size;
+	uint irradianceOffset;
+};
+
+struct Portal {
+	vec3 pos;
+	vec3 normal;
+	float radius;
+};
+
+layout(std430, binding=2) readonly buffer PLANES {
+	Plane planes[];
+};
+layout(std430, binding=3) readonly buffer SPHERES {
+	Sphere spheres[];
+};
+layout(std430, binding=4) readonly buffer BOXES {
+	Box boxes[];
+};
+layout(std430, binding=5) readonly buffer PORTALS {
+	Portal portals[];
+};
+
+const float floatMax = 3.402823466e+38;
+
+// Same as 'getPrimaryRay' in the ray tracing shader, except that this
+// takes a point on the ray target and not the center of a pixel.
+vec3 getPrimaryRayDir(vec2 point) {
+	vec2 aspect = vec2(
+		max(resolution.x / resolution.y, 1),
+		max(resolution.y / resolution.x, 1));
+	vec2 ndc = 2 * point / targetSize - 1;
+	return normalize(invView * normalize(vec3(ndc * aspect, -abs(foveaDist))));
+}
+
+// Get the distance that all rays in the cone can travel before they could hit the given bounding sphere.
+// The closest point of the sphere to the camera is 'dist - radius' away, so if the sphere
+// is anywhere inside of the cone then none of the rays can get any further than that.
+float getSafeDist(vec3 axis, float cosAngle, float sinAngle, vec3 pos, float radius) {
+	vec3 v = pos - cameraPos;
+	float dist = length(v);
+	if (dist <= radius)
+		return 0;
+
+	// The sphere is in the cone if the angle between the axis and the sphere
+	// is less than the cone angle plus the angle that the sphere covers.
+	float sinSphere = radius / dist;
+	float cosSphere = sqrt(1 - sinSphere * sinSphere);
+	float cosMax = cosAngle * cosSphere - sinAngle * sinSphere;
+	if (dot(v / dist, axis) < cosMax)
+		return floatMax;
+	return dist - radius;
+}
+
+void main() {
+	vec2 tileMin = floor(gl_FragCoord.xy) * tileSize;
+	vec2 tileMax = tileMin + tileSize;
+
+	// The cone goes through the middle of the tile and reaches out to its corners.
+	vec3 corners[4] = {
+		getPrimaryRayDir(tileMin),
+		getPrimaryRayDir(vec2(tileMax.x, tileMin.y)),
+		getPrimaryRayDir(vec2(tileMin.x, tileMax.y)),
+		getPrimaryRayDir(tileMax),
+	};
+	vec3 axis = normalize(corners[0] + corners[1] + corners[2] + corners[3]);
+	float cosAngle = 1;
+	for (int i = 0; i < 4; ++i)
+		cosAngle = min(cosAngle, dot(axis, corners[i]));
+	float sinAngle = sqrt(1 - cosAngle * cosAngle);
+
+	float safeDist = floatMax;
+
+	// The ray that hits a plane first is the one closest to the plane's normal.
+	for (uint i = 0; i < planes.length(); ++i) {
+		Plane p = planes[i];
+		float height = dot(p.pos - cameraPos, p.normal);
+		vec3 n = height < 0 ? -p.normal : p.normal;
+		float cosNormal = dot(axis, n);
+		float sinNormal = sqrt(max(0, 1 - cosNormal * cosNormal));
+		float cosClosest = cosNormal > cosAngle ? 1 : cosNormal * cosAngle + sinNormal * sinAngle;
+		if (cosClosest > 0)
+			safeDist = min(safeDist, abs(height) / cosClosest);
+	}
+
+	for (uint i = 0; i < spheres.length(); ++i)
+		safeDist = min(safeDist, getSafeDist(axis, cosAngle, sinAngle, spheres[i].pos, spheres[i].radius));
+	for (uint i = 0; i < boxes.length(); ++i) {
+		vec3 halfSize = 0.5 * vec3(boxes[i].size);
+		safeDist = min(safeDist, getSafeDist(axis, cosAngle, sinAngle, vec3(boxes[i].pos) + halfSize, length(halfSize)));
+	}
+
+	// Portals need to be hit as well for the rays to go through them.
+	for (uint i = 0; i < portals.length(); ++i)
+		safeDist = min(safeDist, getSafeDist(axis, cosAngle, sinAngle, portals[i].pos, portals[i].radius));
+
+	// Leave some room so that the rays don't start right on top of a surface. If there is nothing
+	// at all in the cone then that is passed on as is, and the rays don't have to be traced at all.
+	outFragDist = safeDist == floatMax ? floatMax : max(0, 0.99 * safeDist - 0.01);
+}
@@ -0,0 +1,190 @@
+#version 430
+
+// Denoises the light reaching the primary hits, which is noisy in many-light mode since each pixel
+// only samples one light per frame. Only that light is filtered, and not the color, so that the
+// textures and the reflections stay sharp: the filtered light replaces the noisy light in the color
+// in proportion to how much of it ended up there.
+//
+// The TEMPORAL_ACCUMULATION variant first reprojects the previous frame's light and averages it with
+// this frame's, along with the first two moments of its luminance to estimate how noisy each pixel
+// still is. Then the default variant runs a few times with an increasing step size, filtering the
+// light with a 5x5 kernel whose taps get further apart each time (a-trous wavelet filtering). Taps
+// are weighted down when their distance, normal or material don't match the pixel's, so that the
+// light doesn't leak over edges, and when their luminance differs by more than the noise explains.
+
+layout(location = 12) uniform sampler2D tracedDist;
+layout(location = 13) uniform sampler2D tracedNormal; // Normal, and the material in the alpha.
+
+#ifdef TEMPORAL_ACCUMULATION
+in vec3 vertRayPos;
+in vec3 vertRayDir;
+
+layout(location = 0) out vec4 outFragLight; // Accumulated light, and the variance of its luminance.
+layout(location = 1) out vec4 outFragHistory; // Accumulated light, and how many frames it has seen.
+layout(location = 2) out vec2 outFragMoments; // Accumulated luminance and squared luminance.
+
+layout(location = 0) uniform vec2 resolution;
+layout(location = 14) uniform sampler2D tracedLight;
+layout(location = 15) uniform sampler2D prevHistory;
+layout(location = 16) uniform sampler2D prevMoments;
+layout(location = 17) uniform sampler2D prevDist;
+layout(location = 18) uniform vec3 prevCameraPos;
+layout(location = 19) uniform mat3 prevInvView;
+layout(location = 20) uniform float prevFoveaDist;
+layout(location = 21) uniform bool historyValid; // Whether the previous frame was denoised too.
+
+// The weight of the new frame never goes below this, so that the light still follows changes.
+const float minBlend = 0.1;
+// Pixels with fewer frames of history than this estimate their variance from their neighbors instead.
+const float minVarianceFrames = 4;
+#else
+layout(location = 0) out vec4 outFragLight;
+
+layout(location = 14) uniform sampler2D filterInput; // Light, and the variance of its luminance.
+layout(location = 15) uniform int stepSize;
+
+// The last step combines the filtered light with the traced color.
+layout(location = 16) uniform bool lastStep;
+layout(location = 17) uniform sampler2D tracedColor;
+layout(location = 18) uniform sampler2D tracedLight;
+layout(location = 19) uniform sampler2D tracedLightWeight;
+
+// How quickly the weights of the taps fall off with a difference in luminance, relative to its standard deviation.
+const float luminanceSigma = 4;
+#endif
+
+// How quickly the weights of neighbors fall off with a difference in relative distance per pixel
+// of their offset, and with a difference in normal.
+const float depthSigma = 0.02;
+const float normalPower = 128;
+
+float getLuminance(vec3 color) {
+	return dot(color, vec3(0.2126, 0.7152, 0.0722));
+}
+
+// How much a neighbor's distance and normal match the pixel's. Distances of -1 are
+// portals, which only match other portals.
+float getGeometryWeight(float dist, vec3 normal, float neighborDist, vec3 neighborNormal, float offset) {
+	if ((dist < 0) != (neighborDist < 0))
+		return 0;
+	float depthWeight = dist < 0 ? 1 : exp(-abs(neighborDist - dist) / (depthSigma * max(dist, 0.01) * offset));
+	return depthWeight * pow(max(dot(normal, neighborNormal), 0), normalPower);
+}
+
+#ifdef TEMPORAL_ACCUMULATION
+// Project a world position into the previous frame's ray target, like 'reprojfrag.glsl' does.
+vec2 projectToPrevFrame(vec3 pos) {
+	vec2 aspect = vec2(
+		max(resolution.x / resolution.y, 1),
+		max(resolution.y / resolution.x, 1));
+	vec3 v = transpose(prevInvView) * (pos - prevCameraPos);
+	if (v.z >= 0)
+		return vec2(-1);
+	vec2 ndc = v.xy / -v.z * abs(prevFoveaDist) / aspect;
+	return 0.5 * (ndc + 1);
+}
+
+void main() {
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+	ivec2 size = textureSize(tracedDist, 0);
+	vec3 light = texelFetch(tracedLight, pixel, 0).rgb;
+	float dist = texelFetch(tracedDist, pixel, 0).r;
+	vec3 normal = texelFetch(tracedNormal, pixel, 0).xyz;
+	float luminance = getLuminance(light);
+
+	// Find the same surface in the previous frame. Its distance has to match, just like in the reprojection pass.
+	vec4 history = vec4(0);
+	vec2 moments = vec2(0);
+	if (historyValid && dist >= 0) {
+		vec3 pos = vertRayPos + normalize(vertRayDir) * dist;
+		vec2 uv = projectToPrevFrame(pos);
+		if (all(greaterThanEqual(uv, vec2(0))) && all(lessThan(uv, vec2(1)))) {
+			ivec2 texel = ivec2(uv * vec2(size));
+			float prev = texelFetch(prevDist, texel, 0).r;
+			float expected = distance(prevCameraPos, pos);
+			if (prev >= 0 && abs(prev - expected) < 0.02 * expected) {
+				history = texelFetch(prevHistory, texel, 0);
+				moments = texelFetch(prevMoments, texel, 0).rg;
+			}
+		}
+	}
+
+	float frames = history.a + 1;
+	float blend = max(1 / frames, minBlend);
+	history.rgb = mix(history.rgb, light, blend);
+	moments = mix(moments, vec2(luminance, luminance * luminance), blend);
+	float variance = max(moments.y - moments.x * moments.x, 0);
+
+	// Without enough history the variance comes from the neighbors on the same surface, and it
+	// is overestimated a bit so that the filter starts out wide.
+	if (frames < minVarianceFrames) {
+		vec2 spatialMoments = vec2(0);
+		float weightSum = 0;
+		for (int y = -2; y <= 2; ++y) {
+			for (int x = -2; x <= 2; ++x) {
+				ivec2 q = pixel + ivec2(x, y);
+				if (any(lessThan(q, ivec2(0))) || any(greaterThanEqual(q, size)))
+					continue;
+				float weight = x == 0 && y == 0 ? 1 : getGeometryWeight(dist, normal,
+					texelFetch(tracedDist, q, 0).r, texelFetch(tracedNormal, q, 0).xyz, length(vec2(x, y)));
+				float l = getLuminance(texelFetch(tracedLight, q, 0).rgb);
+				spatialMoments += weight * vec2(l, l * l);
+				weightSum += weight;
+			}
+		}
+		spatialMoments /= weightSum;
+		variance = max(spatialMoments.y - spatialMoments.x * spatialMoments.x, 0) * minVarianceFrames / frames;
+	}
+
+	outFragLight = vec4(history.rgb, variance);
+	outFragHistory = vec4(history.rgb, frames);
+	outFragMoments = moments;
+}
+#else
+void main() {
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+	ivec2 size = textureSize(tracedDist, 0);
+	vec4 center = texelFetch(filterInput, pixel, 0);
+	float dist = texelFetch(tracedDist, pixel, 0).r;
+	vec4 normal = texelFetch(tracedNormal, pixel, 0);
+	float luminance = getLuminance(center.rgb);
+	float luminanceScale = luminanceSigma * sqrt(center.a) + 1e-4;
+
+	// B3 spline kernel, the taps are 'stepSize' pixels apart.
+	const float kernel[5] = { 1.0 / 16, 1.0 / 4, 3.0 / 8, 1.0 / 4, 1.0 / 16 };
+	vec3 light = vec3(0);
+	float variance = 0;
+	float weightSum = 0;
+	for (int y = -2; y <= 2; ++y) {
+		for (int x = -2; x <= 2; ++x) {
+			ivec2 offset = ivec2(x, y) * stepSize;
+			ivec2 q = pixel + offset;
+			if (any(lessThan(q, ivec2(0))) || any(greaterThanEqual(q, size)))
+				continue;
+			vec4 neighbor = texelFetch(filterInput, q, 0);
+			float weight = kernel[x + 2] * kernel[y + 2];
+			if (x != 0 || y != 0) {
+				vec4 neighborNormal = texelFetch(tracedNormal, q, 0);
+				if (neighborNormal.a != normal.a)
+					continue;
+				weight *= getGeometryWeight(dist, normal.xyz,
+					texelFetch(tracedDist, q, 0).r, neighborNormal.xyz, length(vec2(offset)));
+				weight *= exp(-abs(getLuminance(neighbor.rgb) - luminance) / luminanceScale);
+			}
+			light += weight * neighbor.rgb;
+			variance += weight * weight * neighbor.a;
+			weightSum += weight;
+		}
+	}
+	light /= weightSum;
+	variance /= weightSum * weightSum;
+
+	if (lastStep) {
+		vec3 color = texelFetch(tracedColor, pixel, 0).rgb;
+		vec3 noisyLight = texelFetch(tracedLight, pixel, 0).rgb;
+		vec3 lightWeight = texelFetch(tracedLightWeight, pixel, 0).rgb;
+		outFragLight = vec4(color + lightWeight * (light - noisyLight), 1);
+	}
+	else outFragLight = vec4(light, variance);
+}
+#endif
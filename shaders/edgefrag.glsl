@@ -0,0 +1,94 @@
+#version 430
+
+// Finds the pixels of the ray target that are on a silhouette or on an edge between two materials,
+// from the primitive that each pixel's primary ray hit and the distance to it. These pixels are the
+// ones that alias, so the EDGE_SUPERSAMPLING variant of the ray tracing shader traces extra rays for
+// them and leaves everything else alone. The number of edge pixels is counted so that the extra
+// rays can be split evenly between them.
+
+layout(location = 0) out float outFragEdge;
+
+layout(location = 12) uniform sampler2D tracedDist;
+layout(location = 13) uniform usampler2D tracedPrimitive;
+
+struct Plane {
+	vec3 normal;
+	vec3 pos;
+	uint material;
+};
+
+struct Sphere {
+	vec3 pos;
+	float radius;
+	uint material;
+};
+
+struct Box {
+	ivec3 pos;
+	uint material; // Material index in the low 16 bits, and a bit for each face with any voxel face exposed above that.
+	ivec3 size;
+	uint irradianceOffset;
+};
+
+layout(std430, binding=2) readonly buffer PLANES {
+	Plane planes[];
+};
+layout(std430, binding=3) readonly buffer SPHERES {
+	Sphere spheres[];
+};
+layout(std430, binding=4) readonly buffer BOXES {
+	Box boxes[];
+};
+layout(std430, binding=16) buffer EDGE_PIXELS {
+	uint numEdgePixels;
+};
+
+// Same as in the ray tracing shader.
+const uint planeType = 1;
+const uint sphereType = 2;
+const uint voxelType = 3;
+
+// Relative difference in distance between neighboring pixels that counts as a silhouette.
+const float depthThreshold = 0.05;
+
+// Get the material of a primitive, where 0 is nothing at all.
+uint getMaterial(uint primitive) {
+	uint type = primitive >> 28;
+	uint index = primitive & 0x0FFFFFFFu;
+	if (type == planeType)
+		return planes[index].material;
+	if (type == sphereType)
+		return spheres[index].material;
+	if (type == voxelType)
+		return boxes[index].material & 0xFFFFu;
+	return 0;
+}
+
+void main() {
+	ivec2 p = ivec2(gl_FragCoord.xy);
+	ivec2 size = textureSize(tracedDist, 0);
+	float dist = texelFetch(tracedDist, p, 0).r;
+	uint primitive = texelFetch(tracedPrimitive, p, 0).r;
+
+	// Neighboring pixels on the same primitive are never an edge. Neighboring voxels of the same
+	// material are only an edge if there's a jump in distance between them. Distances of -1 are
+	// portals, which are an edge against everything that isn't a portal.
+	bool edge = false;
+	const ivec2 offsets[4] = { ivec2(-1, 0), ivec2(1, 0), ivec2(0, -1), ivec2(0, 1) };
+	for (int i = 0; i < 4 && !edge; ++i) {
+		ivec2 q = p + offsets[i];
+		if (any(lessThan(q, ivec2(0))) || any(greaterThanEqual(q, size)))
+			continue;
+		uint neighbor = texelFetch(tracedPrimitive, q, 0).r;
+		if (neighbor == primitive)
+			continue;
+		float neighborDist = texelFetch(tracedDist, q, 0).r;
+		edge =
+			getMaterial(neighbor) != getMaterial(primitive) ||
+			abs(neighborDist - dist) > depthThreshold * min(abs(neighborDist), abs(dist));
+	}
+
+	if (edge)
+		atomicAdd(numEdgePixels, 1u);
+	outFragEdge = edge ? 1 : 0;
+}
@@ -0,0 +1,82 @@
+#version 430
+
+// Combines the primary surfaces that were found at full resolution with their lighting and
+// reflections that were traced at a lower resolution, see the PRIMARY_SURFACES and SECONDARY_LIGHTING
+// variants of the ray tracing shader. Each pixel blends the low resolution samples around it
+// bilinearly, but samples whose distance or normal don't match the pixel's own are weighted
+// down so that the lighting doesn't bleed over edges (joint bilateral upsampling).
+
+layout(location = 0) out vec4 outFragColor;
+layout(location = 1) out float outFragDist;
+
+layout(location = 12) uniform sampler2D surfaceColor;
+layout(location = 13) uniform sampler2D surfaceDist;
+layout(location = 14) uniform sampler2D surfaceNormal;
+layout(location = 15) uniform sampler2D lowLight;
+layout(location = 16) uniform sampler2D lowReflection;
+layout(location = 17) uniform sampler2D lowDist;
+layout(location = 18) uniform sampler2D lowNormal;
+
+// Same as in the ray tracing shader.
+const vec3 portalColors[] = {
+	vec3(0.8, 0.3, 0.02),
+	vec3(0.02, 0.3, 0.8)
+};
+
+void main() {
+	ivec2 p = ivec2(gl_FragCoord.xy);
+	vec4 surface = texelFetch(surfaceColor, p, 0);
+	float dist = texelFetch(surfaceDist, p, 0).r;
+	vec4 normal = texelFetch(surfaceNormal, p, 0);
+
+	// Find the 2x2 low resolution samples around this pixel.
+	ivec2 lowSize = textureSize(lowLight, 0);
+	vec2 lowPos = (vec2(p) + 0.5) * vec2(lowSize) / vec2(textureSize(surfaceColor, 0)) - 0.5;
+	ivec2 p0 = ivec2(floor(lowPos));
+	vec2 f = lowPos - vec2(p0);
+
+	vec3 light = vec3(0);
+	vec3 reflection = vec3(0);
+	float weightSum = 0;
+	float closestError = 1e30;
+	ivec2 closest = clamp(p0, ivec2(0), lowSize - 1);
+	for (int y = 0; y < 2; ++y) {
+		for (int x = 0; x < 2; ++x) {
+			ivec2 q = clamp(p0 + ivec2(x, y), ivec2(0), lowSize - 1);
+			float d = texelFetch(lowDist, q, 0).r;
+			vec3 n = texelFetch(lowNormal, q, 0).xyz;
+
+			// Distances of -1 are portals, which only match other portals.
+			float distError = abs(d - dist) / max(abs(dist), 0.01);
+			float bilinear = (x == 0 ? 1 - f.x : f.x) * (y == 0 ? 1 - f.y : f.y);
+			float weight = bilinear * exp(-distError * 50) * pow(max(dot(n, normal.xyz), 0), 16);
+			light += weight * texelFetch(lowLight, q, 0).rgb;
+			reflection += weight * texelFetch(lowReflection, q, 0).rgb;
+			weightSum += weight;
+
+			float error = distError + (1 - dot(n, normal.xyz));
+			if (error < closestError) {
+				closestError = error;
+				closest = q;
+			}
+		}
+	}
+
+	// If none of the samples match, like on a thin edge, take the one that is the closest match.
+	if (weightSum > 0.0001) {
+		light /= weightSum;
+		reflection /= weightSum;
+	} else {
+		light = texelFetch(lowLight, closest, 0).rgb;
+		reflection = texelFetch(lowReflection, closest, 0).rgb;
+	}
+
+	vec3 color = light * surface.rgb;
+	int portalIndex = int(normal.a + 0.5) - 1;
+	if (portalIndex >= 0) {
+		// Portal tint, same as in the ray tracing shader.
+		color = portalColors[portalIndex] * (color + 0.5 * portalColors[portalIndex]);
+	}
+	outFragColor = vec4(color + surface.a * reflection, 1);
+	outFragDist = dist;
+}
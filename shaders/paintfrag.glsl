@@ -7,12 +7,18 @@ out vec4 outFragColor;
 layout(location = 0) uniform sampler2D raytraceOutput;
 layout(location = 1) uniform vec2 resolution;
 
-const float quality		= +0.85;
+// The quality of the painting can be changed from the config file. Turning the painting on
+// and changing its number of layers rebuilds this shader with these defines.
+layout(location = 2) uniform float quality;
+#ifndef PAINT_LAYERS
+#define PAINT_LAYERS 11
+#endif
+
 const float brushDetail = +0.6;
 const float strokeBend  = +1.5;
 const float brushSize   = +1.5;
 const float minLayer	= +0.0;
-const float maxLayer	= +11.0;
+const float maxLayer	= +PAINT_LAYERS;
 
 const float pi = 3.1415927;
 const float strokeDeform = 1.0 / (1.0 - 0.25 * abs(strokeBend));
@@ -45,8 +51,10 @@ void main() {
 		return;	
 	}
 
+#ifndef PAINTING
 	outFragColor = texture(raytraceOutput, vertTexcoord);
 	return;
+#endif
 	
 	//number of grid positions on highest detail level
 	float numGrid = 10000.0;
@@ -58,12 +66,12 @@ void main() {
 
 	float numX2 = numX * pow(quality, 1.0 + maxLayer);
 	float numY2 = numY * pow(quality, 1.0 + maxLayer);
-	const float invQuality = 1.0 / quality;
+	float invQuality = 1.0 / quality;
 	float brushStretchPow0 = pow(1.73205081, 1.0 / (2.0 + maxLayer));
 	float brushStretchPow = brushStretchPow0;
 
 
-	for (float layer = 11; layer >= 1; layer -= 1.0) {
+	for (float layer = maxLayer; layer >= 1; layer -= 1.0) {
 
 		// get grid position
 		numX2 *= invQuality;
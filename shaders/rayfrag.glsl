@@ -1,12 +1,108 @@
 #version 430
 
-in vec3 vertRayPos;
-in vec3 vertRayDir;
-
-out vec4 outFragColor;
+// The IRRADIANCE_UPDATE variant of this shader is a compute shader that refreshes the irradiance cache.
+//
+// In mixed resolution mode the PRIMARY_SURFACES variant only finds the primary surfaces at full resolution,
+// the SECONDARY_LIGHTING variant traces their lighting and reflections at a lower resolution, and then
+// 'mixedfrag.glsl' combines the two.
+//
+// With PORTAL_TEXTURES the primary rays that hit a portal read what is behind it from a texture, which
+// the PORTAL_VIEW variant renders once per frame for each portal. See 'getPortalView'.
+//
+// The EDGE_SUPERSAMPLING variant traces extra rays for the pixels on edges, see 'edgefrag.glsl'.
+//
+// With TILE_BINNING the primary rays only test the spheres and boxes that were binned to their tile.
+//
+// The MULTI_VIEW variant traces several views side by side in the same pass, see 'views'.
+//
+// With PICKING the ray through the crosshair is traced too, and what it hit is written for the CPU, see 'pick'.
+#ifdef IRRADIANCE_UPDATE
+layout(local_size_x = 64) in;
+#elif defined(PORTAL_VIEW) || defined(EDGE_SUPERSAMPLING)
+layout(location = 0) out vec4 outFragColor;
+#elif defined(MULTI_VIEW)
+layout(location = 0) out vec4 outFragColor;
+layout(location = 1) out float outFragDist;
+#elif defined(PRIMARY_SURFACES)
+layout(location = 0) out vec4 outFragColor; // Surface color, and reflectance in the alpha.
+layout(location = 1) out float outFragDist;
+layout(location = 2) out vec4 outFragNormal; // Normal, and 1 + the index of the portal the ray went through or 0 in the alpha.
+#elif defined(SECONDARY_LIGHTING)
+layout(location = 0) out vec4 outFragColor; // Light reaching the primary surface.
+layout(location = 1) out float outFragDist;
+layout(location = 2) out vec4 outFragReflection; // Light reflected off of the primary surface, before its reflectance.
+layout(location = 3) out vec4 outFragNormal;
+#else
+layout(location = 0) out vec4 outFragColor;
+layout(location = 1) out float outFragDist;
+layout(location = 2) out uint outFragPrimitive; // The primitive that the primary ray hit, for finding edges.
+// The guides of the denoiser, and the light reaching the primary hit that it filters, see 'denoisefrag.glsl'.
+layout(location = 3) out vec4 outFragNormal; // Normal, and the material in the alpha.
+layout(location = 4) out vec4 outFragLight;
+layout(location = 5) out vec4 outFragLightWeight; // How much of the light reaching the primary hit ends up in the color.
+#endif
 
+#ifdef MULTI_VIEW
+// Each view has its own camera and its own part of the ray target. These are set to the ones of the
+// view that the pixel is in, so that everything else works the same as with a single view.
+const uint maxViews = 2;
+struct View {
+	vec4 cameraPos; // Position of the camera, and its fovea distance in the w.
+	mat3 invView;
+};
+layout(std140, binding=0) uniform VIEWS {
+	vec2 viewResolution; // Size of the part of the window that each view covers.
+	vec2 viewTargetSize; // Size of the part of the ray target that each view covers.
+	uint numViews;
+	View views[maxViews];
+};
+vec2 resolution = vec2(1);
+float foveaDist = 1;
+vec3 cameraPos = vec3(0);
+mat3 invView = mat3(1);
+vec2 targetSize = vec2(1);
+#else
+layout(location = 0) uniform vec2 resolution;
+layout(location = 1) uniform float foveaDist;
+layout(location = 2) uniform vec3 cameraPos;
+layout(location = 3) uniform mat3 invView;
+layout(location = 12) uniform vec2 targetSize;
+#endif
 layout(location = 8) uniform float time;
 layout(location = 9) uniform sampler2DArray textureAtlas;
+layout(location = 10) uniform uint interleave;
+layout(location = 11) uniform uint frameIndex;
+
+// Lights are binned into a world space grid of clusters on the CPU every frame.
+// Points outside of the grid are too far away from every light to be lit by any of them.
+layout(location = 13) uniform vec3 clusterGridMin;
+layout(location = 14) uniform vec3 clusterCellSize;
+layout(location = 15) uniform uvec3 clusterGridDims;
+// Lights are cut off where their attenuation drops below this, which is also how far they reach in the grid.
+layout(location = 35) uniform float lightCutoffRadius;
+
+// How far the primary rays of each tile of the ray target can go before they could hit anything, see 'conefrag.glsl'.
+layout(location = 17) uniform sampler2D coneDistances;
+layout(location = 18) uniform uint coneTileSize;
+
+// With foveated tracing only the pixels in 'foveaSamples' are traced, and 0 means all pixels are traced.
+layout(location = 19) uniform uint numFoveaSamples;
+
+// How many ray segments, either bounces or trips through a portal, each pixel can trace after its primary ray.
+// This is chosen by the CPU every frame so that the whole frame stays within a budget.
+layout(location = 20) uniform uint rayBudget;
+
+// How many entries of the irradiance cache are refreshed this frame, see 'irradianceUpdates'.
+layout(location = 21) uniform uint numIrradianceUpdates;
+
+// Offset of the primary rays from the pixel centers, in pixels. This is only non-zero when the view
+// isn't changing and each frame adds another sample of every pixel to the previous ones.
+layout(location = 22) uniform vec2 pixelJitter;
+
+// The previous frame's camera, for reusing the light samples of the previous frame.
+layout(location = 23) uniform vec3 prevCameraPos;
+layout(location = 24) uniform mat3 prevInvView;
+layout(location = 25) uniform float prevFoveaDist;
 
 //
 // --- RAY TRACING STRUCTURES ---
@@ -16,6 +112,13 @@ struct Ray {
 	vec3 pos;
 	vec3 dir;
 	vec3 invDir; //NOTE: invDir must be set to 1/dir at all times!
+
+	// Each camera ray is really a cone that covers a whole pixel. The cone is 'coneWidth' wide
+	// at the ray's position and it gets 'coneSpread' wider for each unit it travels. This is used
+	// to pick the texture mip level at hits, since there are no screen space derivatives for
+	// reflected rays or rays that went through portals.
+	float coneWidth;
+	float coneSpread;
 };
 
 struct Hit {
@@ -24,6 +127,7 @@ struct Hit {
 	uint material;
 	vec2 texcoord;
 	int portalIndex;
+	uint primitive; // See 'makePrimitiveId'.
 };
 
 //
@@ -58,9 +162,12 @@ struct Sphere {
 	uint material;
 };
 
-struct Voxel {
+// A box of voxels with the same material, see 'mergeVoxelChunk' on the CPU.
+struct Box {
 	ivec3 pos;
-	uint material;
+	uint material; // Material index in the low 16 bits, and a bit for each face with any voxel face exposed above that.
+	ivec3 size;
+	uint irradianceOffset; // First irradiance cache entry of the box, see 'getIrradianceEntry'.
 };
 
 struct Portal {
@@ -69,6 +176,11 @@ struct Portal {
 	float radius;
 };
 
+// Teleports anything entering a portal out of its pair portal.
+struct PortalLink {
+	mat4 transform;
+};
+
 layout(std430, binding=0) readonly buffer LIGHTS {
 	Light lights[];
 };
@@ -81,19 +193,127 @@ layout(std430, binding=2) readonly buffer PLANES {
 layout(std430, binding=3) readonly buffer SPHERES {
 	Sphere spheres[]; //OPTIMIZE: Do we need these at all anymore??
 };
-layout(std430, binding=4) readonly buffer VOXELS {
-	Voxel voxels[];
+layout(std430, binding=4) readonly buffer BOXES {
+	Box boxes[];
 };
 layout(std430, binding=5) readonly buffer PORTALS {
 	Portal portals[]; //OPTIMIZE: There will always be exactly 2 portals at all times.
 };
+layout(std430, binding=6) readonly buffer PORTAL_LINKS {
+	PortalLink portalLinks[]; // portalLinks[i] teleports from portals[i] to its pair.
+};
+layout(std430, binding=7) readonly buffer LIGHT_CLUSTERS {
+	uvec2 lightClusters[]; // Offset and count of the lights in each cluster in 'clusterLights'.
+};
+layout(std430, binding=8) readonly buffer CLUSTER_LIGHTS {
+	uint clusterLights[]; // Indices into 'lights'.
+};
+layout(std430, binding=9) readonly buffer FOVEA_SAMPLES {
+	uint foveaSamples[]; // Pixels of the ray target packed as x | (y << 16).
+};
+layout(std430, binding=11) readonly buffer PORTAL_RECURSION_LIMITS {
+	uint portalRecursionLimits[]; // How deep the recursive views through each portal go this frame.
+};
+// The voxel face that an irradiance cache entry is for.
+struct IrradianceEntry {
+	vec3 pos; // Center of the face.
+	uint index;
+	vec3 normal;
+	uint exposed;
+};
+layout(std430, binding=12) buffer IRRADIANCE_CACHE {
+	vec4 irradianceCache[]; // Diffuse light reaching the center of each voxel face, w is 0 until it is computed.
+};
+#ifdef IRRADIANCE_UPDATE
+layout(std430, binding=13) readonly buffer IRRADIANCE_UPDATES {
+	IrradianceEntry irradianceUpdates[]; // Irradiance cache entries to refresh this frame.
+};
+#endif
+
+#ifdef MANY_LIGHTS
+// In many-light mode each primary hit picks one light to sample, and remembers the pick in
+// a reservoir so that the pixel and its neighbors can reuse it next frame, see 'getSampledLight'.
+struct Reservoir {
+	uint light;   // The picked light, indices past the end of 'lights' are the portal lights.
+	float weight; // Contribution weight of the picked light.
+	float count;  // How many candidate lights the pick was made from.
+	float dist;   // Distance from the camera to the shading point.
+	uint normal;  // Normal of the shading point, packed with 'packSnorm4x8'.
+};
+layout(std430, binding=14) writeonly buffer RESERVOIRS {
+	Reservoir reservoirs[]; // This frame's reservoir of each pixel of the ray target.
+};
+layout(std430, binding=15) readonly buffer PREV_RESERVOIRS {
+	Reservoir prevReservoirs[]; // The previous frame's reservoirs.
+};
+#endif
+
+#ifdef PICKING
+// What the ray through the crosshair hit, after going through any portals. The CPU reads this back
+// a few frames later for placing and removing things, instead of tracing the ray itself.
+struct Pick {
+	vec4 pos;       // Where the ray hit, and 1 in the w if it hit anything.
+	vec4 normal;
+	uint primitive; // See 'makePrimitiveId'.
+};
+layout(std430, binding=18) writeonly buffer PICK {
+	Pick pick;
+};
+#endif
+
+#ifdef TILE_BINNING
+// The spheres and boxes that the primary rays of each tile of the ray target could hit, see 'bincomp.glsl'.
+// Primary rays only test the list of their own tile, and every other ray tests the whole scene.
+layout(location = 33) uniform uint binTileSize;
+layout(location = 34) uniform uint binTileCapacity;
+layout(std430, binding=17) readonly buffer TILE_PRIMITIVES {
+	uint tilePrimitives[]; // The number of primitives in each tile, and then 'binTileCapacity' primitive IDs for each tile.
+};
+int primaryTile = -1; // The tile of the primary ray that is being traced, or -1 for any other ray.
+uint primaryTileStart = 0; // Where the primitive IDs of 'primaryTile' start.
+#endif
+
+// These can be overridden with defines to build specialized variants of this shader.
+// NUM_PLANES and NUM_PORTALS fix the number of planes and portals at compile time so
+// that the loops over them can be unrolled, and NO_SHADOWS compiles out the shadow rays.
+#ifndef NUM_BOUNCES
+#define NUM_BOUNCES 2
+#endif
+#ifndef PORTAL_RECURSION
+#define PORTAL_RECURSION 4
+#endif
+#ifndef NUM_PLANES
+#define NUM_PLANES planes.length()
+#endif
+#ifndef NUM_PORTALS
+#define NUM_PORTALS portals.length()
+#endif
 
 const float floatMax = 3.402823466e+38;
-const uint numBounces = 2;
-const uint portalRecursion = 4;
-const float lightCutoffRadius = 0.001;
+const uint numBounces = NUM_BOUNCES;
+const uint portalRecursion = PORTAL_RECURSION;
 const float rayEpsilon = 0.001;
 const float pi = 3.1415927;
+const float skyDist = 10000.0;
+
+// How many more ray segments the current pixel can trace, see 'rayBudget'.
+uint raysLeft = 0;
+// State of the random number generator of the current pixel, see 'random'.
+uint rngState = 0;
+// The primitive that the last traced primary ray hit, see 'makePrimitiveId'.
+uint primaryPrimitive = 0;
+// The material of the last traced primary hit, and how much of the light reaching it ends up in its color.
+uint primaryMaterial = 0;
+vec3 primaryLightWeight = vec3(0);
+#ifdef PORTAL_TEXTURES
+// Whether rays stop at the portals instead of going through them, this is only done for the primary rays.
+bool stopAtPortals = false;
+// The portal that the primary ray already went through before it was traced, or -1.
+int primaryPortal = -1;
+#endif
+const uint numLightCandidates = 4;
+const uint numReusedNeighbors = 2;
+const float neighborRadius = 10;
 const vec3 ambientLight = vec3(0.01);
 const vec3 portalColors[] = {
 	vec3(0.8, 0.3, 0.02),
@@ -105,6 +325,13 @@ float rand(vec2 seed) {
 	return fract(sin(dot(seed, vec2(12.9898, 78.233))) * 43758.5453);
 }
 
+// Get a random number in [0, 1) from the current pixel's random number generator (PCG).
+float random() {
+	rngState = rngState * 747796405u + 2891336453u;
+	uint word = ((rngState >> ((rngState >> 28u) + 4u)) ^ rngState) * 277803737u;
+	return float((word >> 22u) ^ word) * (1.0 / 4294967296.0);
+}
+
 // Plane-Ray intersection
 float intersect(Ray r, Plane p) {
 	const float epsilon = 0.001;
@@ -132,18 +359,30 @@ float intersect(Ray r, Sphere s) {
 	}
 }
 
-// Ray-Voxel intersetion
-float intersect(Ray r, Voxel v) {
+// Ray-Box intersetion
+float intersect(Ray r, Box b) {
 	//NOTE: If 'invDir' is 0 or INF, then this will completely bug out..
-	vec3 ld = (vec3(v.pos) - r.pos) * r.invDir;
-	vec3 rd = (vec3(v.pos) - r.pos) * r.invDir + r.invDir;
+	vec3 ld = (vec3(b.pos) - r.pos) * r.invDir;
+	vec3 rd = (vec3(b.pos) - r.pos) * r.invDir + vec3(b.size) * r.invDir;
 	vec3 mind = min(ld, rd);
 	vec3 maxd = max(ld, rd);
 	float dmin = max(max(mind.x, mind.y), mind.z);
 	float dmax = min(min(maxd.x, maxd.y), maxd.z);
 	if (dmin > dmax)
 		return floatMax;
-	else return dmin < 0 ? dmax : dmin;
+	if (dmin < 0)
+		return dmax;
+
+	// A ray can't get in through a face that is covered by other voxels, it would hit those first.
+	// Near edges the ray might be entering through either face, so it only has to be one of them.
+	const float epsilon = 0.001;
+	uint exposedFaces = b.material >> 16;
+	for (uint axis = 0; axis < 3; ++axis) {
+		uint face = 2 * axis + (r.invDir[axis] > 0 ? 0 : 1);
+		if (mind[axis] >= dmin - epsilon && (exposedFaces >> face & 1u) != 0)
+			return dmin;
+	}
+	return floatMax;
 }
 
 // Ray-portal intersection
@@ -162,16 +401,89 @@ float intersect(Ray r, Portal p) {
 	return floatMax;
 }
 
-// Get a portal that transforms into "portal space"
-mat3 getPortalMatrix(Portal portal) {
-	vec3 n = normalize(portal.normal);
-	vec3 b = vec3(0, 1, 0);
-	if (abs(dot(n, b)) > 0.99) {
-		b = vec3(1, 0, 0);
-	}
-	vec3 t = normalize(cross(n, b));
-	b = normalize(cross(t, n));
-	return transpose(mat3(t, b, n));
+// Each primitive is identified by its type in the top 4 bits and its index in the rest,
+// and 0 means nothing was hit. These are the same as in the visibility buffer shaders.
+const uint planeType = 1;
+const uint sphereType = 2;
+const uint voxelType = 3;
+const uint portalType = 4; // Only for primary rays that stopped at a portal.
+uint makePrimitiveId(uint type, uint index) {
+	return (type << 28) | index;
+}
+
+// Fill in the hit data for a ray hitting a plane at distance 'd'.
+void setPlaneHit(inout Hit hit, Ray ray, float d, uint index) {
+	Plane plane = planes[index];
+	hit.dist = d;
+	hit.material = plane.material;
+	hit.normal = plane.normal;
+	hit.texcoord = vec2(1);
+	hit.primitive = makePrimitiveId(planeType, index);
+}
+
+// Fill in the hit data for a ray hitting a sphere at distance 'd'.
+void setSphereHit(inout Hit hit, Ray ray, float d, uint index) {
+	Sphere sphere = spheres[index];
+	hit.dist = d;
+	hit.material = sphere.material;
+	hit.normal = normalize(ray.pos + ray.dir * d - sphere.pos);
+	hit.primitive = makePrimitiveId(sphereType, index);
+
+	// Convert hit position to texture coordinates:
+	// https://en.wikipedia.org/wiki/UV_mapping
+	vec3 n = -hit.normal;
+	hit.texcoord = vec2(0.5 + atan(n.z, n.x) / (2 * pi), 0.5 - asin(n.y) / pi);
+}
+
+// Fill in the hit data for a ray hitting a box of voxels at distance 'd'.
+void setBoxHit(inout Hit hit, Ray ray, float d, uint index) {
+	Box box = boxes[index];
+	hit.dist = d;
+	hit.material = box.material & 0xFFFFu;
+	hit.primitive = makePrimitiveId(voxelType, index);
+	vec3 hitPos = ray.pos + ray.dir * d;
+	vec3 halfSize = 0.5 * vec3(box.size);
+	vec3 n = (hitPos - vec3(box.pos) - halfSize) / halfSize;
+	vec3 a = abs(n);
+	uint axis = a.x > a.y && a.x > a.z ? 0 : a.y > a.z ? 1 : 2;
+	hit.normal = vec3(0);
+	hit.normal[axis] = sign(n[axis]);
+
+	// The texture tiles once per voxel, so find where the hit is within its voxel of the box.
+	vec3 p = hitPos - vec3(box.pos);
+	p -= clamp(floor(p), vec3(0), vec3(box.size - 1));
+
+	// Calculate texture coordinates of the voxel:
+	// https://en.wikipedia.org/wiki/Cube_mapping#Memory_addressing
+	float dotX = abs(dot(hit.normal, vec3(1, 0, 0)));
+	float dotY = abs(dot(hit.normal, vec3(0, 1, 0)));
+	float dotZ = abs(dot(hit.normal, vec3(0, 0, 1)));
+	if (dotX > 0.8)
+		hit.texcoord = abs(p.zy);
+	if (dotY > 0.8)
+		hit.texcoord = abs(p.zx);
+	if (dotZ > 0.8)
+		hit.texcoord = abs(p.xy);
+}
+
+// Get the hit data for a ray that doesn't hit anything.
+Hit getMissedHit() {
+	Hit hit;
+	hit.portalIndex = -1;
+	hit.material = 0;
+	hit.normal = vec3(0);
+	hit.dist = floatMax;
+	hit.texcoord = vec2(1);
+	hit.primitive = 0;
+	return hit;
+}
+
+// Move the ray to the hit point and reflect it off of the hit surface.
+void reflectRay(inout Ray ray, Hit hit) {
+	ray.pos += ray.dir * hit.dist;
+	ray.coneWidth += ray.coneSpread * hit.dist;
+	ray.dir = normalize(reflect(ray.dir, hit.normal));
+	ray.invDir = 1 / ray.dir;
 }
 
 // Get the closest hit data for the given ray.
@@ -181,6 +493,10 @@ Hit getClosestHit(inout Ray ray) {
 	
 	Hit hit;
 	hit.portalIndex = -1;
+#ifdef PORTAL_TEXTURES
+	if (stopAtPortals)
+		hit.portalIndex = primaryPortal;
+#endif
 	bool rayHitPortal;
 	uint numPortalsTravelled = 0;
 
@@ -188,105 +504,96 @@ Hit getClosestHit(inout Ray ray) {
 	// If the closest hit object is a portal, then the
 	// ray is teleported to the portal and we loop through
 	// the scene again until the portal recursion limit is
-	// reached, or the closest hit isn't a portal.
+	// reached, or the closest hit isn't a portal. Portals
+	// that are small on screen have a lower recursion limit.
 	do {
 		hit.material = 0;
 		hit.normal = vec3(0);
 		hit.dist = floatMax;
 		hit.texcoord = vec2(1);
+		hit.primitive = 0;
 		rayHitPortal = false;
 
-		for (uint i = 0; i < planes.length(); ++i) {
-			Plane plane = planes[i];
-			float d = intersect(ray, plane);
-			if (d > 0 && d < hit.dist) {
-				hit.dist = d;
-				hit.material = plane.material;
-				hit.normal = plane.normal;
-				hit.texcoord = vec2(1);
-			}
+		for (uint i = 0; i < NUM_PLANES; ++i) {
+			float d = intersect(ray, planes[i]);
+			if (d > 0 && d < hit.dist)
+				setPlaneHit(hit, ray, d, i);
 		}
 
-		for (uint i = 0; i < spheres.length(); ++i) {
-			Sphere sphere = spheres[i];
-			float d = intersect(ray, sphere);
-			if (d > 0 && d < hit.dist) {
-				hit.dist = d;
-				hit.material = sphere.material;
-				hit.normal = normalize(ray.pos + ray.dir * d - sphere.pos);
-				vec3 d = -hit.normal;
-
-				// Convert hit position to texture coordinates:
-				// https://en.wikipedia.org/wiki/UV_mapping
-				hit.texcoord = vec2(0.5 + atan(d.z, d.x) / (2 * pi), 0.5 - asin(d.y) / pi);
+#ifdef TILE_BINNING
+		if (primaryTile >= 0 && numPortalsTravelled == 0) {
+			// Ties go to the lowest primitive ID, just like in the loops over the whole scene,
+			// so that the hit doesn't depend on the order that the list was built in.
+			uint numPrimitives = tilePrimitives[primaryTile];
+			for (uint i = 0; i < numPrimitives; ++i) {
+				uint primitive = tilePrimitives[primaryTileStart + i];
+				uint index = primitive & 0x0FFFFFFFu;
+				float d = (primitive >> 28) == sphereType ? intersect(ray, spheres[index]) : intersect(ray, boxes[index]);
+				if (d > 0 && (d < hit.dist || (d == hit.dist && primitive < hit.primitive))) {
+					if ((primitive >> 28) == sphereType)
+						setSphereHit(hit, ray, d, index);
+					else setBoxHit(hit, ray, d, index);
+				}
 			}
-		}
-		
-		for (uint i = 0; i < voxels.length(); ++i) {
-			Voxel voxel = voxels[i];
-			float d = intersect(ray, voxel);
-			if (d > 0 && d < hit.dist) {
-				hit.dist = d;
-				Voxel voxel = voxels[i];
-				float d = hit.dist;
-				hit.material = voxel.material;
-				vec3 hitPos = ray.pos + ray.dir * hit.dist;
-				vec3 p = hitPos - vec3(voxel.pos);
-				hit.normal = normalize(vec3(ivec3(2.0001 * (p - 0.5))));
-
-				// Calculate texture coordinates of the voxel:
-				// https://en.wikipedia.org/wiki/Cube_mapping#Memory_addressing
-				float dotX = abs(dot(hit.normal, vec3(1, 0, 0)));
-				float dotY = abs(dot(hit.normal, vec3(0, 1, 0)));
-				float dotZ = abs(dot(hit.normal, vec3(0, 0, 1)));
-				if (dotX > 0.8)
-					hit.texcoord = abs(p.zy);
-				if (dotY > 0.8)
-					hit.texcoord = abs(p.zx);
-				if (dotZ > 0.8)
-					hit.texcoord = abs(p.xy);
+		} else
+#endif
+		{
+			for (uint i = 0; i < spheres.length(); ++i) {
+				float d = intersect(ray, spheres[i]);
+				if (d > 0 && d < hit.dist)
+					setSphereHit(hit, ray, d, i);
+			}
+
+			for (uint i = 0; i < boxes.length(); ++i) {
+				float d = intersect(ray, boxes[i]);
+				if (d > 0 && d < hit.dist)
+					setBoxHit(hit, ray, d, i);
 			}
 		}
 
 		if (numPortalsTravelled < portalRecursion) {
-			for (uint i = 0; i < portals.length(); ++i) {
+			for (uint i = 0; i < NUM_PORTALS; ++i) {
 				float d = intersect(ray, portals[i]);
-				if (d > 0 && d < hit.dist) {
+				if (d > 0 && d < hit.dist && numPortalsTravelled < portalRecursionLimits[i] && raysLeft > 0) {
 					
 					// The ray hit a portal (P1), now we have to teleport it from
 					// that portal to its pair portal (P2).
 					Portal P1 = portals[i];
-					Portal P2 = portals[1 - i];
 					
 					vec3 p = ray.pos + ray.dir * d - P1.pos;
 					float dist2 = dot(p, p);
 					float r = P1.radius * max(rand(p.xy + time), 0.80);
 					// Add random noise around the portal as a makeshift animation
 					if (dist2 < r * r) {
+#ifdef PORTAL_TEXTURES
+						// What is behind the portal is read from its view texture instead.
+						if (stopAtPortals) {
+							hit.dist = d;
+							hit.normal = P1.normal;
+							hit.material = 0;
+							hit.primitive = makePrimitiveId(portalType, i);
+							if (hit.portalIndex < 0)
+								hit.portalIndex = int(i);
+							break;
+						}
+#endif
 						if (hit.portalIndex < 0) {
 							// Record which portal we hit for lighting.
 							hit.portalIndex = int(i);
 						}
 
-						// Since the ray is going INTO one portal and OUT of the other
-						// one of the portal normals has to be flipped.
-						P1.normal = -P1.normal;
-						mat3 M1 = getPortalMatrix(P1);
-						mat3 M2 = getPortalMatrix(P2);
-
-						// We first transform the ray from "world space" to "portal 1 space",
-						// then we pretend these "portal 1 coordinates" are actually
-						// "portal 2 coordinates" and undo the "portal 2 space" transformation
-						// this effectively teleports the ray from portal 1 to portal 2, and
-						// keeps the relative ray direction intact.
-						ray.pos = ray.pos + ray.dir * d;
-						ray.pos = P2.pos + inverse(M2) * M1 * (ray.pos - P1.pos);
-						ray.dir = inverse(M2) * M1 * ray.dir;
+						// Teleport the ray from this portal (P1) to its pair portal (P2). The
+						// transform that does this is precomputed on the CPU, see 'getPortalLink'.
+						mat4 link = portalLinks[i].transform;
+						ray.coneWidth += ray.coneSpread * d;
+						ray.pos = (link * vec4(ray.pos + ray.dir * d, 1)).xyz;
+						ray.dir = mat3(link) * ray.dir;
 						ray.invDir = 1 / ray.dir;
 
 						ray.pos += ray.dir * rayEpsilon;
 						rayHitPortal = true;
 						numPortalsTravelled += 1;
+						raysLeft -= 1;
 					}
 					break;
 				}
@@ -294,85 +601,650 @@ Hit getClosestHit(inout Ray ray) {
 		}			
 	} while(rayHitPortal);
 
-	ray.pos += ray.dir * hit.dist;
-	ray.dir = normalize(reflect(ray.dir, hit.normal));
-	ray.invDir = 1 / ray.dir;
+	reflectRay(ray, hit);
 	return hit;
 }
 
-// Calculate lighting for a given ray position and direction hitting a surface
-vec3 getLightColor(Light light, vec3 pos, vec3 dir, vec3 normal) {
+#ifdef VISIBILITY_BUFFER
+layout(location = 16) uniform usampler2D visibilityBuffer;
+
+// Get the primary hit for a pixel of the ray target. Instead of intersecting every object in the scene
+// this only intersects the one object that was rasterized into the visibility buffer at this pixel.
+//NOTE: Just like getClosestHit this modifies the ray so that it's facing its reflected direction.
+Hit getVisibleHit(inout Ray ray, uvec2 pixel) {
+	uint primitive = texelFetch(visibilityBuffer, ivec2(pixel), 0).r;
+	uint type = primitive >> 28;
+	uint index = primitive & 0x0FFFFFFFu;
+
+	Hit hit = getMissedHit();
+	if (type == planeType) {
+		float d = intersect(ray, planes[index]);
+		if (d > 0 && d < floatMax)
+			setPlaneHit(hit, ray, d, index);
+	} else if (type == sphereType) {
+		float d = intersect(ray, spheres[index]);
+		if (d > 0 && d < floatMax)
+			setSphereHit(hit, ray, d, index);
+	} else if (type == voxelType) {
+		float d = intersect(ray, boxes[index]);
+		if (d > 0 && d < floatMax)
+			setBoxHit(hit, ray, d, index);
+	}
+
+	// Portals aren't rasterized, so if one is in front of the hit we need to trace the whole
+	// scene anyway. The same goes for the rare pixels right at the edges of objects where the
+	// rasterizer and the ray disagree about whether the object was hit.
+	bool fullTrace = primitive != 0 && hit.primitive == 0;
+	for (uint i = 0; i < NUM_PORTALS; ++i) {
+		float d = intersect(ray, portals[i]);
+		if (d > 0 && d < hit.dist)
+			fullTrace = true;
+	}
+	if (fullTrace)
+		return getClosestHit(ray);
+
+	reflectRay(ray, hit);
+	return hit;
+}
+#endif
+
+// Get the hit for a primary ray going through the given pixel of the ray target. If the cone
+// pre-pass found nothing at all in front of the pixel's tile then the ray can't hit anything.
+Hit getPrimaryHit(inout Ray ray, uvec2 pixel, bool coneIsEmpty) {
+	if (coneIsEmpty) {
+		Hit hit = getMissedHit();
+		reflectRay(ray, hit);
+		return hit;
+	}
+#ifdef TILE_BINNING
+	// Tiles that ran out of room test the whole scene instead.
+	uvec2 numTiles = (uvec2(targetSize) + binTileSize - 1) / binTileSize;
+	uint tile = (pixel.y / binTileSize) * numTiles.x + pixel.x / binTileSize;
+	if (tilePrimitives[tile] <= binTileCapacity) {
+		primaryTile = int(tile);
+		primaryTileStart = numTiles.x * numTiles.y + tile * binTileCapacity;
+	}
+#endif
+#ifdef VISIBILITY_BUFFER
+	Hit hit = getVisibleHit(ray, pixel);
+#else
+	Hit hit = getClosestHit(ray);
+#endif
+#ifdef TILE_BINNING
+	primaryTile = -1;
+#endif
+	return hit;
+}
+
+// Check if anything blocks the ray before it travels 'tMax'. This is only used for shadows
+// so unlike getClosestHit it doesn't compute any normals or texture coordinates, it doesn't
+// go through portals, and it stops as soon as it finds anything in the way.
+//
+// Portals don't transmit light: a portal on the way blocks the light just like any other
+// surface would. The light that comes out of the portals is faked by the portal lights.
+bool isOccluded(Ray ray, float tMax) {
+	for (uint i = 0; i < NUM_PLANES; ++i) {
+		float d = intersect(ray, planes[i]);
+		if (d > 0 && d < tMax)
+			return true;
+	}
+	for (uint i = 0; i < spheres.length(); ++i) {
+		float d = intersect(ray, spheres[i]);
+		if (d > 0 && d < tMax)
+			return true;
+	}
+	for (uint i = 0; i < boxes.length(); ++i) {
+		float d = intersect(ray, boxes[i]);
+		if (d > 0 && d < tMax)
+			return true;
+	}
+	for (uint i = 0; i < NUM_PORTALS; ++i) {
+		float d = intersect(ray, portals[i]);
+		if (d > 0 && d < tMax)
+			return true;
+	}
+	return false;
+}
+
+// Calculate lighting for a given ray position and direction hitting a surface, ignoring shadows.
+// A zero 'dir' leaves out the specular highlight, which depends on the view.
+vec3 getUnshadowedLightColor(Light light, vec3 pos, vec3 dir, vec3 normal) {
 	float lightDist = length(light.pos - pos);
 	float attenuation = 1 / (lightDist * lightDist);
-	if (attenuation > lightCutoffRadius) { // Light cutoff radius
-		Ray lightRay;
-		lightRay.pos = light.pos;
-		lightRay.dir = normalize(pos - lightRay.pos);
-		lightRay.invDir = 1 / lightRay.dir;
-		vec3 lightDir = lightRay.dir;
-
-		// Cast a light ray to check if the light is occluded.
-		Hit hit = getClosestHit(lightRay);
-		if (abs(hit.dist - lightDist) < rayEpsilon) {
-			// "Full" Phong lighting, but everything has the same specular value..
-			float diffuse = max(0, dot(-lightDir, normal));
-			float specular = pow(max(0, dot(-dir, reflect(lightDir, normal))), 16.0);
-			return light.color * attenuation * (diffuse + specular);
-		}	
+	vec3 lightDir = (pos - light.pos) / lightDist;
+
+	// The light is too far away, or it is behind the surface so the surface itself blocks it.
+	if (attenuation <= lightCutoffRadius || dot(lightDir, normal) >= 0)
+		return vec3(0);
+
+	// "Full" Phong lighting, but everything has the same specular value..
+	float diffuse = max(0, dot(-lightDir, normal));
+	float specular = pow(max(0, dot(-dir, reflect(lightDir, normal))), 16.0);
+	return light.color * attenuation * (diffuse + specular);
+}
+
+// Calculate lighting for a given ray position and direction hitting a surface.
+// A zero 'dir' leaves out the specular highlight, which depends on the view.
+vec3 getLightColor(Light light, vec3 pos, vec3 dir, vec3 normal) {
+	vec3 color = getUnshadowedLightColor(light, pos, dir, normal);
+	if (color == vec3(0))
+		return color;
+
+#ifndef NO_SHADOWS
+	// Cast a shadow ray from the surface towards the light to check if the light is occluded.
+	// It stops just short of the light, because the portal lights sit right on their portal
+	// disks, which would otherwise block their own light.
+	Ray shadowRay;
+	shadowRay.pos = pos + normal * rayEpsilon;
+	shadowRay.dir = normalize(light.pos - shadowRay.pos);
+	shadowRay.invDir = 1 / shadowRay.dir;
+	if (isOccluded(shadowRay, distance(shadowRay.pos, light.pos) - rayEpsilon))
+		return vec3(0);
+#endif
+	return color;
+}
+
+// Get the light that a portal gives off towards a point, mostly in front of the portal.
+Light getPortalLight(uint i, vec3 pos) {
+	float cone = dot(portals[i].normal, normalize(pos - portals[i].pos));
+	Light light;
+	light.pos = portals[i].pos;
+	light.color = 9 * portalColors[i] * cone * cone;
+	return light;
+}
+
+// Get a light by its index, where the indices past the end of 'lights' are the portal lights.
+Light getLightByIndex(uint index, vec3 pos) {
+	return index < lights.length() ? lights[index] : getPortalLight(index - lights.length(), pos);
+}
+
+// Calculate the light reaching a surface point directly from all of the lights that reach the point's
+// cluster and from the portals. A zero 'dir' gives just the diffuse light, see 'getLightColor'.
+vec3 getDirectLight(vec3 pos, vec3 dir, vec3 normal) {
+	vec3 lighting = vec3(0);
+	ivec3 cell = ivec3(floor((pos - clusterGridMin) / clusterCellSize));
+	if (all(greaterThanEqual(cell, ivec3(0))) && all(lessThan(cell, ivec3(clusterGridDims)))) {
+		uvec2 cluster = lightClusters[cell.x + clusterGridDims.x * (cell.y + clusterGridDims.y * cell.z)];
+		for (uint i = 0; i < cluster.y; ++i) {
+			Light light = lights[clusterLights[cluster.x + i]];
+			lighting += getLightColor(light, pos, dir, normal);
+		}
+	}
+	// Portals also give off a light.
+	for (uint i = 0; i < NUM_PORTALS; ++i)
+		lighting += getLightColor(getPortalLight(i, pos), pos, dir, normal);
+	return lighting;
+}
+
+#ifdef MANY_LIGHTS
+float getLuminance(vec3 color) {
+	return dot(color, vec3(0.2126, 0.7152, 0.0722));
+}
+
+// Add a light to the reservoir with the given resampling weight. The light replaces the reservoir's
+// pick with a probability proportional to its weight, so in the end each light is picked with a
+// probability proportional to its weight without having to remember all of them.
+bool updateReservoir(inout Reservoir r, inout float weightSum, uint light, float weight, float count) {
+	weightSum += weight;
+	r.count += count;
+	if (random() * weightSum < weight) {
+		r.light = light;
+		return true;
+	}
+	return false;
+}
+
+// Get the light arriving at a surface point with a single shadow ray, no matter how many lights there
+// are. This uses weighted reservoir sampling: a few random candidate lights from the point's cluster
+// are resampled by how much light they would give without shadows, and only the picked one gets a
+// shadow ray. On primary hits the reservoirs of the same surface in the previous frame, at this pixel
+// and at a couple of its neighbors, are resampled too, so good picks spread over time and space.
+vec3 getSampledLight(vec3 pos, vec3 dir, vec3 normal, bool reuse, uvec2 pixel) {
+	Reservoir r = Reservoir(0, 0, 0, distance(cameraPos, pos), packSnorm4x8(vec4(normal, 0)));
+	float weightSum = 0;
+	float pickedTarget = 0;
+
+	uvec2 cluster = uvec2(0);
+	ivec3 cell = ivec3(floor((pos - clusterGridMin) / clusterCellSize));
+	if (all(greaterThanEqual(cell, ivec3(0))) && all(lessThan(cell, ivec3(clusterGridDims))))
+		cluster = lightClusters[cell.x + clusterGridDims.x * (cell.y + clusterGridDims.y * cell.z)];
+	uint numCandidates = cluster.y + NUM_PORTALS;
+	uint numLights = lights.length() + NUM_PORTALS;
+	for (uint i = 0; i < numLightCandidates && numCandidates > 0; ++i) {
+		uint k = min(uint(random() * numCandidates), numCandidates - 1);
+		uint light = k < cluster.y ? clusterLights[cluster.x + k] : lights.length() + k - cluster.y;
+		float target = getLuminance(getUnshadowedLightColor(getLightByIndex(light, pos), pos, dir, normal));
+		if (updateReservoir(r, weightSum, light, target * numCandidates, 1))
+			pickedTarget = target;
 	}
 
-	// The light is too far away.
-	return vec3(0);
+	if (reuse) {
+		// Find where this surface was in the previous frame.
+		vec2 aspect = vec2(
+			max(resolution.x / resolution.y, 1),
+			max(resolution.y / resolution.x, 1));
+		vec3 v = transpose(prevInvView) * (pos - prevCameraPos);
+		vec2 prevPixel = (0.5 * v.xy / -v.z * abs(prevFoveaDist) / aspect + 0.5) * targetSize;
+		float expectedDist = distance(prevCameraPos, pos);
+		for (uint i = 0; i <= numReusedNeighbors && v.z < 0; ++i) {
+			vec2 offset = i == 0 ? vec2(0) : neighborRadius * (vec2(random(), random()) * 2 - 1);
+			ivec2 p = ivec2(prevPixel + offset);
+			if (any(lessThan(p, ivec2(0))) || any(greaterThanEqual(p, ivec2(targetSize))))
+				continue;
+
+			// Only reuse reservoirs of the same surface, and limit how much history they carry so that they adapt to changes.
+			Reservoir prev = prevReservoirs[p.y * int(targetSize.x) + p.x];
+			if (prev.count == 0 || prev.light >= numLights || abs(prev.dist - expectedDist) > 0.05 * expectedDist ||
+				dot(unpackSnorm4x8(prev.normal).xyz, normal) < 0.9)
+				continue;
+			prev.count = min(prev.count, 20 * numLightCandidates);
+			float target = getLuminance(getUnshadowedLightColor(getLightByIndex(prev.light, pos), pos, dir, normal));
+			if (updateReservoir(r, weightSum, prev.light, target * prev.weight * prev.count, prev.count))
+				pickedTarget = target;
+		}
+	}
+
+	r.weight = pickedTarget > 0 ? weightSum / (r.count * pickedTarget) : 0;
+	if (reuse)
+		reservoirs[pixel.y * uint(targetSize.x) + pixel.x] = r;
+	return getLightColor(getLightByIndex(r.light, pos), pos, dir, normal) * r.weight;
+}
+#endif
+
+// The irradiance cache has an entry for each voxel face on the surface of each box. They go face by
+// face in the order -X, +X, -Y, +Y, -Z, +Z, and row by row within each face.
+uint getIrradianceEntry(Box box, vec3 pos, vec3 normal) {
+	vec3 a = abs(normal);
+	uint axis = a.x > a.y && a.x > a.z ? 0 : a.y > a.z ? 1 : 2;
+	uint u = (axis + 1) % 3;
+	uint v = (axis + 2) % 3;
+	uvec3 faceSizes = uvec3(box.size.yzx * box.size.zxy);
+	uint offset = box.irradianceOffset + (normal[axis] > 0 ? faceSizes[axis] : 0);
+	for (uint i = 0; i < axis; ++i)
+		offset += 2 * faceSizes[i];
+	uvec3 cell = uvec3(clamp(ivec3(floor(pos - 0.5 * normal)) - box.pos, ivec3(0), box.size - 1));
+	return offset + cell[v] * uint(box.size[u]) + cell[u];
+}
+
+// Get the cached diffuse light of the voxel face that was hit at 'pos'. The w component
+// is 0 if the hit isn't a voxel, or if the entry of the face wasn't computed yet.
+vec4 getCachedIrradiance(Hit hit, vec3 pos) {
+	if ((hit.primitive >> 28) != voxelType)
+		return vec4(0);
+	return irradianceCache[getIrradianceEntry(boxes[hit.primitive & 0x0FFFFFFFu], pos, hit.normal)];
+}
+
+// Get the light reaching a hit point directly from the lights, in whichever way this variant of the shader does it.
+vec3 getHitLight(Hit hit, vec3 pos, vec3 dir, bool primary, uvec2 pixel) {
+	// Nothing is lit when nothing was hit.
+	if (hit.normal == vec3(0))
+		return vec3(0);
+
+#ifdef CACHED_IRRADIANCE
+	// Bounces off of voxels use the cached diffuse light of the voxel face, once it has been computed.
+	vec4 cached = primary ? vec4(0) : getCachedIrradiance(hit, pos);
+	if (cached.w > 0)
+		return cached.rgb;
+#endif
+#if defined(MANY_LIGHTS) && defined(MULTI_VIEW)
+	// The views don't keep their reservoirs between frames.
+	return getSampledLight(pos, dir, hit.normal, false, pixel);
+#elif defined(MANY_LIGHTS)
+	// Only primary hits that didn't go through a portal can be found in the previous frame.
+	return getSampledLight(pos, dir, hit.normal, primary && hit.portalIndex < 0, pixel);
+#else
+	return getDirectLight(pos, dir, hit.normal);
+#endif
+}
+
+// Get the texture mip level for a hit, from how much of the surface the ray cone covers.
+float getTextureLod(Hit hit, float coneWidth, vec3 rayDir) {
+	// Voxel texture coordinates go from 0 to 1 across each face, while sphere texture
+	// coordinates wrap around the sphere once.
+	float texcoordsPerUnit = 1;
+	if ((hit.primitive >> 28) == sphereType)
+		texcoordsPerUnit = 1 / (pi * spheres[hit.primitive & 0x0FFFFFFFu].radius);
+
+	float footprint = coneWidth / max(abs(dot(rayDir, hit.normal)), 0.1);
+	float texels = footprint * texcoordsPerUnit * float(textureSize(textureAtlas, 0).x);
+	return log2(max(texels, 1e-6));
+}
+
+// Get the color of the surface that was hit, including its texture.
+vec3 getSurfaceColor(Hit hit, float coneWidth, vec3 rayDir) {
+	int texidx = materials[hit.material].textureIndex;
+	vec3 texcolor = texidx < 0 ? vec3(1) : textureLod(textureAtlas, vec3(hit.texcoord, texidx), getTextureLod(hit, coneWidth, rayDir)).rgb;
+	return texcolor * materials[hit.material].color.rgb;
+}
+
+#ifdef PORTAL_TEXTURES
+layout(location = 26) uniform sampler2D portalViews;
+
+// The camera that the portal views were rendered from. For the primary rays this is the
+// current camera, while the portal views themselves read the previous frame's views.
+layout(location = 27) uniform vec3 portalViewCameraPos;
+layout(location = 28) uniform mat3 portalViewInvView;
+layout(location = 29) uniform float portalViewFoveaDist;
+
+// Get the color seen through a point on a portal. The views of the portals are side by side in the
+// 'portalViews' texture, and each one has a texel for each direction of the camera that rendered it.
+vec3 getPortalView(uint i, vec3 pos) {
+	vec3 v = transpose(portalViewInvView) * (pos - portalViewCameraPos);
+	if (v.z >= 0)
+		return vec3(0);
+	vec2 aspect = vec2(
+		max(resolution.x / resolution.y, 1),
+		max(resolution.y / resolution.x, 1));
+	vec2 ndc = v.xy / -v.z * abs(portalViewFoveaDist) / aspect;
+	if (any(greaterThan(abs(ndc), vec2(1))))
+		return vec3(0);
+
+	// Don't filter across the edge between the two views.
+	vec2 size = vec2(textureSize(portalViews, 0));
+	vec2 texel = (0.5 * ndc + 0.5) * vec2(0.5 * size.x, size.y);
+	texel.x = clamp(texel.x, 0.5, 0.5 * size.x - 0.5) + float(i) * 0.5 * size.x;
+	return textureLod(portalViews, texel / size, 0).rgb;
 }
+#endif
 
-// Trace the ray through the scene and bounce it around, accumulating color
-void trace(Ray ray, out vec3 color) {
+// Trace the ray through the scene and bounce it around, accumulating color.
+// Also outputs the distance to the primary hit, or -1 if the primary ray went through a portal.
+// For mixed resolution mode the light reaching the primary hit, its normal, and the light
+// that is reflected off of it are also output separately.
+void trace(Ray ray, uvec2 pixel, bool coneIsEmpty, out vec3 color, out float primaryDist,
+	out vec3 primaryLight, out vec3 primaryNormal, out vec3 reflectedColor) {
 	float reflectance = 1;
+	float reflectedWeight = 1;
 	color = vec3(0);
+	primaryLight = vec3(0);
+	primaryNormal = vec3(0);
+	primaryLightWeight = vec3(0);
+	reflectedColor = vec3(0);
 	
 	// Bounce the ray around until the bounce limit is reached or the reflectance gets low.
 	for (uint bounce = 0; bounce < 1 + numBounces && reflectance > 0.05; ++bounce) {
+		if (bounce > 0) {
+			if (raysLeft == 0)
+				break;
+			raysLeft -= 1;
+		}
 		
 		// Trace the ray to the nearest object.
 		vec3 rayDir = ray.dir;
-		Hit hit = getClosestHit(ray);
-
-		// Calculate light contribution from all lights.
-		vec3 lighting = ambientLight;
-		for (uint i = 0; i < lights.length(); ++i) {
-			Light light = lights[i];
-			lighting += getLightColor(lights[i], ray.pos, rayDir, hit.normal);
+#ifdef PORTAL_TEXTURES
+		stopAtPortals = bounce == 0;
+#endif
+		Hit hit = bounce == 0 ? getPrimaryHit(ray, pixel, coneIsEmpty) : getClosestHit(ray);
+		if (bounce == 0) {
+			primaryDist = hit.portalIndex < 0 ? min(hit.dist, skyDist) : -1;
+			primaryPrimitive = hit.primitive;
 		}
-		// Portals also give off a light.
-		for (uint i = 0; i < portals.length(); ++i) {
-			Light light;
-			light.pos = portals[i].pos;
-			light.color = 9 * portalColors[i];
-			float cone = dot(portals[i].normal, normalize(ray.pos - portals[i].pos));
-			cone *= cone;
-			lighting += getLightColor(light, ray.pos, rayDir, hit.normal) * cone;
+#ifdef PORTAL_TEXTURES
+		// The portal views already include the portal's tint.
+		if ((hit.primitive >> 28) == portalType) {
+			color += reflectance * getPortalView(hit.primitive & 0x0FFFFFFFu, ray.pos);
+			break;
 		}
+#endif
+
+		// Calculate light contribution from all of the lights.
+		vec3 lighting = ambientLight + getHitLight(hit, ray.pos, rayDir, bounce == 0, pixel);
 
-		// Check if the material is textured.
-		int texidx = materials[hit.material].textureIndex;
-		vec3 texcolor = texidx < 0 ? vec3(1) : texture(textureAtlas, vec3(hit.texcoord, texidx)).rgb;
+		vec3 surfaceColor = getSurfaceColor(hit, ray.coneWidth, rayDir);
+
+		// Reflections off of curved spheres spread out more.
+		if ((hit.primitive >> 28) == sphereType)
+			ray.coneSpread += 2 * ray.coneWidth / spheres[hit.primitive & 0x0FFFFFFFu].radius;
 		
-		color += reflectance * lighting * texcolor * materials[hit.material].color.rgb;
+		color += reflectance * lighting * surfaceColor;
+		if (bounce == 0) {
+			primaryLight = lighting;
+			primaryNormal = hit.normal;
+			primaryMaterial = hit.material;
+			primaryLightWeight = surfaceColor;
+		}
+		else reflectedColor += reflectedWeight * lighting * surfaceColor;
 		if (hit.portalIndex >= 0) {
 			// Portal tint.
 			color = portalColors[hit.portalIndex] * (color + 0.5 * portalColors[hit.portalIndex]);
+			primaryLightWeight *= portalColors[hit.portalIndex];
+			if (bounce > 0)
+				reflectedColor = portalColors[hit.portalIndex] * (reflectedColor + 0.5 * portalColors[hit.portalIndex]);
 		}
 		reflectance *= materials[hit.material].reflectance;
+		if (bounce > 0)
+			reflectedWeight *= materials[hit.material].reflectance;
 		ray.pos += ray.dir * rayEpsilon;
 	}
 }
 
-void main() {
+// With interleaved tracing only 1 out of every 'interleave' pixels of the ray target is traced
+// each frame, and the traced pixels rotate each frame so that every pixel is traced once every
+// 'interleave' frames. The traced pixels are packed together into a smaller viewport so that
+// neighboring fragments stay coherent, and this maps a packed pixel back to the full ray target.
+// The rest of the pixels are filled in by the reprojection pass.
+//
+// With foveated tracing the traced pixels are instead read from a list that gets sparser
+// away from the center of the screen, and the rest are filled in by the upsampling pass.
+uvec2 getTracedPixel(uvec2 packedPixel) {
+	if (numFoveaSamples != 0) {
+		uint foveaSample = foveaSamples[packedPixel.y * uint(targetSize.x) + packedPixel.x];
+		return uvec2(foveaSample & 0xFFFFu, foveaSample >> 16);
+	}
+	if (interleave == 2)
+		return uvec2(2 * packedPixel.x + ((packedPixel.y + frameIndex) & 1u), packedPixel.y);
+	if (interleave == 4) {
+		const uint order[] = { 0u, 3u, 1u, 2u };
+		uint k = order[frameIndex & 3u];
+		return 2 * packedPixel + uvec2(k & 1u, k >> 1);
+	}
+	return packedPixel;
+}
+
+// Generate the camera ray going through the center of the given pixel of the ray target, offset by 'jitter' pixels.
+// This does the same thing as the vertex shader but for an arbitrary pixel.
+Ray getPrimaryRay(uvec2 pixel, vec2 jitter) {
+	vec2 aspect = vec2(
+		max(resolution.x / resolution.y, 1),
+		max(resolution.y / resolution.x, 1));
+	vec2 ndc = 2 * (vec2(pixel) + 0.5 + jitter) / targetSize - 1;
 	Ray ray;
-	ray.pos = vertRayPos;
-	ray.dir = normalize(vertRayDir);
+	ray.pos = cameraPos;
+	ray.dir = normalize(invView * normalize(vec3(ndc * aspect, -abs(foveaDist))));
 	ray.invDir = 1.0 / ray.dir;
+
+	// The cone starts out as a point at the camera and spreads out by about a pixel per unit of fovea distance.
+	ray.coneWidth = 0;
+	ray.coneSpread = 2 * max(aspect.x / targetSize.x, aspect.y / targetSize.y) / abs(foveaDist);
+	return ray;
+}
+
+#ifdef PICKING
+// The crosshair is at the corner between the pixels in the middle of the ray target.
+void writePick() {
+	Ray ray = getPrimaryRay(uvec2(targetSize) / 2, vec2(-0.5));
+	raysLeft = rayBudget;
+	Hit hit = getClosestHit(ray);
+	pick.pos = vec4(ray.pos, hit.normal == vec3(0) ? 0 : 1);
+	pick.normal = vec4(hit.normal, 0);
+	pick.primitive = hit.primitive;
+}
+#endif
+
+#ifdef IRRADIANCE_UPDATE
+void main() {
+	if (gl_GlobalInvocationID.x >= numIrradianceUpdates)
+		return;
+
+	// Light the center of the voxel face.
+	IrradianceEntry entry = irradianceUpdates[gl_GlobalInvocationID.x];
+	irradianceCache[entry.index] = vec4(getDirectLight(entry.pos, vec3(0), entry.normal), 1);
+}
+#elif defined(PORTAL_VIEW)
+// Render the views through both portals side by side, each one the size of the ray target. Every texel
+// is the camera ray through it teleported by the portal, whether or not the ray actually hits the portal,
+// so that texels around the edge of the portal have something sensible in them for filtering.
+// Inside the views the primary rays that hit a portal read the previous frame's portal views.
+void main() {
+	uint i = uint(gl_FragCoord.x) / uint(targetSize.x);
+	uvec2 pixel = uvec2(gl_FragCoord.xy) - uvec2(i * uint(targetSize.x), 0);
+	Ray ray = getPrimaryRay(pixel, vec2(0));
+	float denom = dot(ray.dir, portals[i].normal);
+	float d = abs(denom) > 0.001 ? dot(portals[i].pos - ray.pos, portals[i].normal) / denom : 0;
+	if (d <= 0) {
+		outFragColor = vec4(0, 0, 0, 1);
+		return;
+	}
+
+	// Teleport the ray just like 'getClosestHit' does.
+	mat4 link = portalLinks[i].transform;
+	ray.coneWidth += ray.coneSpread * d;
+	ray.pos = (link * vec4(ray.pos + ray.dir * d, 1)).xyz;
+	ray.dir = mat3(link) * ray.dir;
+	ray.invDir = 1 / ray.dir;
+	ray.pos += ray.dir * rayEpsilon;
+
+	raysLeft = rayBudget - 1;
+	rngState = (pixel.y * uint(targetSize.x) + pixel.x + i * 7919u) * 9781u + frameIndex * 6271u;
+	primaryPortal = int(i);
+	vec3 color;
+	float dist;
+	vec3 primaryLight;
+	vec3 primaryNormal;
+	vec3 reflectedColor;
+	trace(ray, pixel, false, color, dist, primaryLight, primaryNormal, reflectedColor);
+	outFragColor = vec4(color, 1.0);
+}
+#elif defined(MULTI_VIEW)
+// Trace all of the views at once. The views share everything but their primary rays, which skip the
+// cone pre-pass and the visibility buffer since those are only made for the main camera.
+void main() {
+	uint i = min(uint(gl_FragCoord.x / viewTargetSize.x), numViews - 1);
+	resolution = viewResolution;
+	targetSize = viewTargetSize;
+	cameraPos = views[i].cameraPos.xyz;
+	foveaDist = views[i].cameraPos.w;
+	invView = views[i].invView;
+
+	uvec2 pixel = uvec2(gl_FragCoord.xy) - uvec2(i * uint(targetSize.x), 0);
+	Ray ray = getPrimaryRay(pixel, vec2(0));
+	raysLeft = rayBudget;
+	rngState = (pixel.y * uint(targetSize.x) + pixel.x + i * 7919u) * 9781u + frameIndex * 6271u;
+	vec3 color;
+	float dist;
+	vec3 primaryLight;
+	vec3 primaryNormal;
+	vec3 reflectedColor;
+	trace(ray, pixel, false, color, dist, primaryLight, primaryNormal, reflectedColor);
+	outFragColor = vec4(color, 1.0);
+	outFragDist = dist >= 0 ? min(dist, skyDist) : dist;
+}
+#elif defined(EDGE_SUPERSAMPLING)
+layout(location = 30) uniform sampler2D tracedColor;
+layout(location = 31) uniform sampler2D edgeMask;
+layout(location = 32) uniform uint edgeSampleBudget; // How many extra samples all of the edge pixels get in total.
+
+layout(std430, binding=16) readonly buffer EDGE_PIXELS {
+	uint numEdgePixels;
+};
+
+// Rotated grid sample positions within a pixel.
+const uint maxEdgeSamples = 4;
+const vec2 edgeSampleOffsets[maxEdgeSamples] = {
+	vec2(-0.375, -0.125),
+	vec2(0.125, -0.375),
+	vec2(0.375, 0.125),
+	vec2(-0.125, 0.375),
+};
+
+// Trace a few more jittered samples of each pixel on an edge and average them with the pixel's first sample.
+// The sample budget is split evenly between all of the edge pixels that 'edgefrag.glsl' found.
+void main() {
+	uvec2 pixel = uvec2(gl_FragCoord.xy);
+	vec3 color = texelFetch(tracedColor, ivec2(pixel), 0).rgb;
+	if (texelFetch(edgeMask, ivec2(pixel), 0).r == 0) {
+		outFragColor = vec4(color, 1.0);
+		return;
+	}
+
+	// Round the share of the budget randomly so that the budget is met on average.
+	rngState = (pixel.y * uint(targetSize.x) + pixel.x) * 7927u + frameIndex * 3469u;
+	float share = float(edgeSampleBudget) / float(max(numEdgePixels, 1u));
+	uint numSamples = min(uint(share + random()), maxEdgeSamples);
+
+	float startDist = texelFetch(coneDistances, ivec2(pixel / coneTileSize), 0).r;
+	bool coneIsEmpty = startDist == floatMax;
+	if (coneIsEmpty)
+		startDist = 0;
+	for (uint i = 0; i < numSamples; ++i) {
+		Ray ray = getPrimaryRay(pixel, edgeSampleOffsets[(i + frameIndex) % maxEdgeSamples]);
+		ray.pos += ray.dir * startDist;
+		ray.coneWidth += ray.coneSpread * startDist;
+		raysLeft = rayBudget;
+
+		vec3 sampleColor;
+		float sampleDist;
+		vec3 primaryLight;
+		vec3 primaryNormal;
+		vec3 reflectedColor;
+		trace(ray, pixel, coneIsEmpty, sampleColor, sampleDist, primaryLight, primaryNormal, reflectedColor);
+		color += sampleColor;
+	}
+	outFragColor = vec4(color / float(1 + numSamples), 1.0);
+}
+#else
+void main() {
+	// The last row of foveated samples is only partially filled.
+	if (numFoveaSamples != 0 && uint(gl_FragCoord.y) * uint(targetSize.x) + uint(gl_FragCoord.x) >= numFoveaSamples)
+		discard;
+
+#ifdef PICKING
+	// The first fragment always runs, however the traced pixels are packed.
+	if (uvec2(gl_FragCoord.xy) == uvec2(0))
+		writePick();
+#endif
+	uvec2 pixel = getTracedPixel(uvec2(gl_FragCoord.xy));
+	Ray ray = getPrimaryRay(pixel, pixelJitter);
+
+	// Skip the empty space in front of the camera.
+	float startDist = texelFetch(coneDistances, ivec2(pixel / coneTileSize), 0).r;
+	bool coneIsEmpty = startDist == floatMax;
+	if (coneIsEmpty)
+		startDist = 0;
+	ray.pos += ray.dir * startDist;
+	ray.coneWidth += ray.coneSpread * startDist;
+
+	raysLeft = rayBudget;
+	rngState = (pixel.y * uint(targetSize.x) + pixel.x) * 9781u + frameIndex * 6271u;
+
+#ifdef PRIMARY_SURFACES
+	// Only find the primary surface, its lighting is traced separately at a lower resolution.
+	vec3 rayDir = ray.dir;
+	Hit hit = getPrimaryHit(ray, pixel, coneIsEmpty);
+	outFragColor = vec4(getSurfaceColor(hit, ray.coneWidth, rayDir), materials[hit.material].reflectance);
+	outFragDist = hit.portalIndex < 0 ? min(hit.dist + startDist, skyDist) : -1;
+	outFragNormal = vec4(hit.normal, hit.portalIndex + 1);
+#else
 	vec3 fragColor;
-	trace(ray, fragColor);
+	float fragDist;
+	vec3 primaryLight;
+	vec3 primaryNormal;
+	vec3 reflectedColor;
+	trace(ray, pixel, coneIsEmpty, fragColor, fragDist, primaryLight, primaryNormal, reflectedColor);
+	if (fragDist >= 0)
+		fragDist = min(fragDist + startDist, skyDist);
+#ifdef SECONDARY_LIGHTING
+	outFragColor = vec4(primaryLight, 1.0);
+	outFragReflection = vec4(reflectedColor, 1.0);
+	outFragNormal = vec4(primaryNormal, 1.0);
+#else
 	outFragColor = vec4(fragColor, 1.0);
-}
\ No newline at end of file
+	outFragPrimitive = primaryPrimitive;
+	outFragNormal = vec4(primaryNormal, primaryMaterial);
+	outFragLight = vec4(primaryLight, 1.0);
+	outFragLightWeight = vec4(primaryLightWeight, 1.0);
+#endif
+	outFragDist = fragDist;
+#endif
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,142 @@
+#version 430
+
+in vec3 vertRayPos;
+in vec3 vertRayDir;
+
+layout(location = 0) out vec4 outFragColor;
+layout(location = 1) out float outFragDist;
+
+layout(location = 0) uniform vec2 resolution;
+layout(location = 1) uniform float foveaDist;
+layout(location = 10) uniform uint interleave;
+layout(location = 11) uniform uint frameIndex;
+layout(location = 12) uniform sampler2D currentColor;
+layout(location = 13) uniform sampler2D currentDist;
+layout(location = 14) uniform sampler2D prevColor;
+layout(location = 15) uniform sampler2D prevDist;
+layout(location = 16) uniform vec3 prevCameraPos;
+layout(location = 17) uniform mat3 prevInvView;
+layout(location = 18) uniform float prevFoveaDist;
+layout(location = 19) uniform uint accumulatedFrames; // How many samples of this same view the previous frame has averaged.
+
+// Check if the pixel was traced this frame, see 'getTracedPixel' in the ray tracing shader.
+bool isTraced(uvec2 p) {
+	if (interleave == 2)
+		return ((p.x + p.y + frameIndex) & 1u) == 0;
+	if (interleave == 4) {
+		const uint order[] = { 0u, 3u, 1u, 2u };
+		return (p.x & 1u) + 2 * (p.y & 1u) == order[frameIndex & 3u];
+	}
+	return true;
+}
+
+// Inverse of 'getTracedPixel' in the ray tracing shader - only valid for traced pixels.
+ivec2 getPackedPixel(ivec2 p) {
+	if (interleave == 2)
+		return ivec2(p.x / 2, p.y);
+	if (interleave == 4)
+		return p / 2;
+	return p;
+}
+
+// Project a world position into the previous frame's ray target. This does the
+// inverse of what the vertex shader did to generate the rays of the previous frame.
+vec2 projectToPrevFrame(vec3 pos) {
+	vec2 aspect = vec2(
+		max(resolution.x / resolution.y, 1),
+		max(resolution.y / resolution.x, 1));
+	vec3 v = transpose(prevInvView) * (pos - prevCameraPos);
+	if (v.z >= 0)
+		return vec2(-1);
+	vec2 ndc = v.xy / -v.z * abs(prevFoveaDist) / aspect;
+	return 0.5 * (ndc + 1);
+}
+
+// Returns how much the previous frame disagrees with a guess of how far along the ray the
+// surface is. If the previous frame saw something at a different distance at that spot then
+// the surface was occluded (or seen through a portal) and we can't reuse the previous frame.
+float getReprojectionError(vec3 rayPos, vec3 rayDir, float dist, out vec3 color) {
+	color = vec3(0);
+	if (dist < 0)
+		return 1;
+
+	vec3 pos = rayPos + rayDir * dist;
+	vec2 uv = projectToPrevFrame(pos);
+	if (any(lessThan(uv, vec2(0))) || any(greaterThanEqual(uv, vec2(1))))
+		return 1;
+
+	ivec2 texel = ivec2(uv * textureSize(prevDist, 0));
+	float prev = texelFetch(prevDist, texel, 0).r;
+	if (prev < 0)
+		return 1;
+	float expected = distance(prevCameraPos, pos);
+	color = texelFetch(prevColor, texel, 0).rgb;
+	return abs(prev - expected) / expected;
+}
+
+void main() {
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+	ivec2 size = textureSize(currentDist, 0);
+	if (isTraced(uvec2(pixel))) {
+		outFragColor = texelFetch(currentColor, getPackedPixel(pixel), 0);
+		outFragDist = texelFetch(currentDist, getPackedPixel(pixel), 0).r;
+
+		// The view didn't change, so add this frame's jittered sample to the average.
+		if (accumulatedFrames > 0)
+			outFragColor.rgb = mix(texelFetch(prevColor, pixel, 0).rgb, outFragColor.rgb, 1.0 / float(accumulatedFrames + 1));
+		return;
+	}
+
+	// This pixel wasn't traced, but some of its neighbors were. We use their distances as
+	// guesses for how far away this pixel's surface is, and then we look up what the
+	// previous frame saw there. If none of the guesses agree with the previous frame
+	// we fall back to averaging the closest neighbors.
+	vec3 rayPos = vertRayPos;
+	vec3 rayDir = normalize(vertRayDir);
+	vec3 neighborColor = vec3(0);
+	float neighborDist = 0;
+	float neighborWeight = 0;
+	float closestDist = 1e30;
+	float bestError = 0.02; // Maximum relative error we allow.
+	vec3 bestColor;
+	float bestDist = -1;
+	for (int dy = -1; dy <= 1; ++dy) {
+		for (int dx = -1; dx <= 1; ++dx) {
+			ivec2 p = clamp(pixel + ivec2(dx, dy), ivec2(0), size - 1);
+			if (!isTraced(uvec2(p)))
+				continue;
+
+			float d = texelFetch(currentDist, getPackedPixel(p), 0).r;
+			vec3 c = texelFetch(currentColor, getPackedPixel(p), 0).rgb;
+			vec3 prev;
+			float error = getReprojectionError(rayPos, rayDir, d, prev);
+			if (error < bestError) {
+				bestError = error;
+				bestColor = prev;
+				bestDist = d;
+			}
+
+			// Keep track of the neighbors that are closest to the camera (portals count as close).
+			float depth = d < 0 ? 0 : d;
+			if (depth < 0.95 * closestDist) {
+				closestDist = depth;
+				neighborColor = vec3(0);
+				neighborDist = 0;
+				neighborWeight = 0;
+			}
+			if (depth < 1.05 * closestDist) {
+				neighborColor += c;
+				neighborDist += d;
+				neighborWeight += 1;
+			}
+		}
+	}
+
+	if (bestDist >= 0) {
+		outFragColor = vec4(bestColor, 1);
+		outFragDist = bestDist;
+	} else {
+		outFragColor = vec4(neighborColor / neighborWeight, 1);
+		outFragDist = neighborDist / neighborWeight;
+	}
+}
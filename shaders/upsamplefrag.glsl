@@ -0,0 +1,77 @@
+#version 430
+
+// Reconstructs the full ray target from the foveated samples. The ray target is split into
+// tiles, and each tile is traced at a different rate depending on how far it is from the
+// center of the screen: either every pixel, or 1 pixel in every 2x2, 4x4 or 8x8 block.
+// The traced pixel of each block is always its bottom left pixel, so every pixel that is
+// traced at a coarse rate is also traced at all of the finer rates.
+
+layout(location = 0) out vec4 outFragColor;
+layout(location = 1) out float outFragDist;
+
+layout(location = 12) uniform sampler2D tracedColor;
+layout(location = 13) uniform sampler2D tracedDist;
+layout(location = 14) uniform uint foveaTileSize;
+layout(location = 15) uniform uvec2 numFoveaTiles;
+
+layout(std430, binding=10) readonly buffer FOVEA_TILES {
+	uvec2 foveaTiles[]; // Index of the first traced pixel of each tile in the traced textures, and the block size.
+};
+
+uvec2 getTile(ivec2 p) {
+	return foveaTiles[(p.y / foveaTileSize) * numFoveaTiles.x + p.x / foveaTileSize];
+}
+
+// Check if the given pixel was traced.
+bool isTraced(ivec2 p) {
+	if (any(lessThan(p, ivec2(0))) || any(greaterThanEqual(p, ivec2(numFoveaTiles * foveaTileSize))))
+		return false;
+	int blockSize = int(getTile(p).y);
+	return p.x % blockSize == 0 && p.y % blockSize == 0;
+}
+
+// Get where the given traced pixel is in the traced textures.
+ivec2 getSamplePixel(ivec2 p) {
+	uvec2 tile = getTile(p);
+	uint blockSize = tile.y;
+	uvec2 local = uvec2(p) % foveaTileSize / blockSize;
+	uint index = tile.x + local.y * (foveaTileSize / blockSize) + local.x;
+	uint width = textureSize(tracedColor, 0).x;
+	return ivec2(index % width, index / width);
+}
+
+void main() {
+	ivec2 p = ivec2(gl_FragCoord.xy);
+	int blockSize = int(getTile(p).y);
+
+	// Bilinearly interpolate between the traced pixels at the corners of this pixel's block.
+	// A corner might be in a tile that is traced at a coarser rate, in which case it might not
+	// have been traced, and its weight is given to the other corners. The bottom left corner
+	// is always in the same tile, so it's always traced.
+	ivec2 p0 = p / blockSize * blockSize;
+	vec2 f = vec2(p - p0) / blockSize;
+	vec3 color = vec3(0);
+	float weightSum = 0;
+	float maxWeight = 0;
+	float dist = 0;
+	for (int y = 0; y < 2; ++y) {
+		for (int x = 0; x < 2; ++x) {
+			ivec2 corner = p0 + blockSize * ivec2(x, y);
+			float weight = (x == 0 ? 1 - f.x : f.x) * (y == 0 ? 1 - f.y : f.y);
+			if (weight <= 0 || !isTraced(corner))
+				continue;
+			ivec2 samplePixel = getSamplePixel(corner);
+			color += weight * texelFetch(tracedColor, samplePixel, 0).rgb;
+			weightSum += weight;
+
+			// Distances can't be blended across edges, so take the closest traced pixel's distance.
+			if (weight > maxWeight) {
+				maxWeight = weight;
+				dist = texelFetch(tracedDist, samplePixel, 0).r;
+			}
+		}
+	}
+
+	outFragColor = vec4(color / weightSum, 1);
+	outFragDist = dist;
+}
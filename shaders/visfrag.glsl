@@ -0,0 +1,75 @@
+#version 430
+
+// Writes the ID of the closest primitive to the visibility buffer, see 'visvert.glsl'.
+// The ray tracing shader reconstructs the full primary hit from this ID.
+
+layout(location = 0) out uint outPrimitive;
+
+flat in uint vertPrimitive;
+in vec3 vertRayDir;
+
+layout(location = 2) uniform vec3 cameraPos;
+layout(location = 3) uniform mat3 invView;
+layout(location = 4) uniform uint primitiveType;
+
+struct Plane {
+	vec3 normal;
+	vec3 pos;
+	uint material;
+};
+
+struct Sphere {
+	vec3 pos;
+	float radius;
+	uint material;
+};
+
+layout(std430, binding=2) readonly buffer PLANES {
+	Plane planes[];
+};
+layout(std430, binding=3) readonly buffer SPHERES {
+	Sphere spheres[];
+};
+
+// Same as in 'visvert.glsl'.
+const uint sphereType = 2;
+const float nearDist = 0.01;
+const float skyDist = 10000.0;
+
+// Get the window space depth of a world space position, this matches the projection in 'visvert.glsl'.
+float getDepth(vec3 pos) {
+	float z = dot(pos - cameraPos, invView[2]);
+	float a = (skyDist + nearDist) / (nearDist - skyDist);
+	float b = 2 * skyDist * nearDist / (nearDist - skyDist);
+	return 0.5 * (a * z + b) / -z + 0.5;
+}
+
+void main() {
+	outPrimitive = vertPrimitive;
+
+	// The voxels are rasterized exactly, so the voxel variant of this shader keeps
+	// the rasterized depth and doesn't disable early depth testing by writing to it.
+#ifndef VOXELS_ONLY
+	vec3 dir = normalize(vertRayDir);
+	uint index = vertPrimitive & 0x0FFFFFFFu;
+	float t;
+	if (primitiveType == sphereType) {
+		Sphere s = spheres[index];
+		vec3 oc = cameraPos - s.pos;
+		float b = dot(oc, dir);
+		float discriminant = b * b - dot(oc, oc) + s.radius * s.radius;
+		if (discriminant < 0)
+			discard;
+		t = -b - sqrt(discriminant);
+	} else {
+		Plane p = planes[index];
+		float denom = dot(dir, p.normal);
+		if (abs(denom) <= 0.001)
+			discard;
+		t = dot(p.pos - cameraPos, p.normal) / denom;
+	}
+	if (t <= 0.001)
+		discard;
+	gl_FragDepth = min(getDepth(cameraPos + dir * t), 1);
+#endif
+}
@@ -0,0 +1,110 @@
+#version 430
+
+// Rasterizes the primary hits of all the planes, spheres and voxels into the visibility buffer.
+// Voxels are drawn as instanced boxes straight from the box buffer, spheres as instanced
+// camera facing quads that are ray traced per fragment, and planes as fullscreen quads that
+// are also ray traced per fragment. No vertex buffers are needed, everything is generated
+// from gl_VertexID and gl_InstanceID.
+
+flat out uint vertPrimitive;
+out vec3 vertRayDir;
+
+layout(location = 0) uniform vec2 resolution;
+layout(location = 1) uniform float foveaDist;
+layout(location = 2) uniform vec3 cameraPos;
+layout(location = 3) uniform mat3 invView;
+layout(location = 4) uniform uint primitiveType;
+layout(location = 5) uniform vec2 jitter; // Same as 'pixelJitter' in the ray tracing shader, but in NDC.
+
+struct Plane {
+	vec3 normal;
+	vec3 pos;
+	uint material;
+};
+
+struct Sphere {
+	vec3 pos;
+	float radius;
+	uint material;
+};
+
+struct Box {
+	ivec3 pos;
+	uint material; // Material index in the low 16 bits, and a bit for each face with any voxel face exposed above that.
+	ivec3 size;
+	uint irradianceOffset;
+};
+
+layout(std430, binding=3) readonly buffer SPHERES {
+	Sphere spheres[];
+};
+layout(std430, binding=4) readonly buffer BOXES {
+	Box boxes[];
+};
+
+// Same as in the ray tracing shader.
+const uint planeType = 1;
+const uint sphereType = 2;
+const uint voxelType = 3;
+const float nearDist = 0.01;
+const float skyDist = 10000.0;
+
+// 6 faces of 2 counter clockwise triangles each, as corners of the unit cube (corner bits are xyz).
+const uint cubeIndices[36] = {
+	0, 1, 2, 1, 3, 2, // -X
+	4, 6, 5, 5, 6, 7, // +X
+	0, 4, 1, 1, 4, 5, // -Y
+	2, 3, 6, 3, 7, 6, // +Y
+	0, 2, 4, 2, 6, 4, // -Z
+	1, 5, 3, 3, 5, 7, // +Z
+};
+
+// Project a world space position the same way the primary rays are shot, see 'getPrimaryRay'.
+// Shifting everything against the jitter makes the pixel centers see what the jittered rays see.
+vec4 project(vec3 pos) {
+	vec2 aspect = vec2(
+		max(resolution.x / resolution.y, 1),
+		max(resolution.y / resolution.x, 1));
+	vec3 v = transpose(invView) * (pos - cameraPos);
+	float a = (skyDist + nearDist) / (nearDist - skyDist);
+	float b = 2 * skyDist * nearDist / (nearDist - skyDist);
+	return vec4(v.xy * abs(foveaDist) / aspect - jitter * -v.z, a * v.z + b, -v.z);
+}
+
+void main() {
+	vertPrimitive = (primitiveType << 28) | uint(gl_InstanceID);
+	if (primitiveType == voxelType) {
+		uint corner = cubeIndices[gl_VertexID];
+		Box box = boxes[gl_InstanceID];
+		vec3 pos = vec3(box.pos) + vec3(corner >> 2, (corner >> 1) & 1u, corner & 1u) * vec3(box.size);
+		vertRayDir = pos - cameraPos;
+		gl_Position = project(pos);
+
+		// Faces that are covered by other voxels collapse to a point and aren't rasterized.
+		if ((box.material >> (16 + gl_VertexID / 6) & 1u) == 0)
+			gl_Position = vec4(0, 0, 0, 1);
+	} else if (primitiveType == sphereType) {
+		// Cover the sphere with a quad in front of it that faces the camera. The quad is
+		// slightly bigger than the sphere so the silhouette is never clipped.
+		Sphere sphere = spheres[gl_InstanceID];
+		vec3 toCamera = cameraPos - sphere.pos;
+		float dist = length(toCamera);
+		vec3 forward = toCamera / dist;
+		vec3 right = normalize(cross(abs(forward.y) < 0.99 ? vec3(0, 1, 0) : vec3(1, 0, 0), forward));
+		vec3 up = cross(forward, right);
+		vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1) * 2 - 1;
+		float size = 1.5 * sphere.radius;
+		vec3 pos = sphere.pos + forward * min(sphere.radius, dist - 2 * nearDist) + size * (corner.x * right + corner.y * up);
+		vertRayDir = pos - cameraPos;
+		gl_Position = project(pos);
+	} else {
+		// Planes are infinite so just cover the whole screen with them. The quad is
+		// twice as big as the screen so that it still covers it after the jitter.
+		vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1) * 4 - 2;
+		vec2 aspect = vec2(
+			max(resolution.x / resolution.y, 1),
+			max(resolution.y / resolution.x, 1));
+		vertRayDir = invView * vec3(corner * aspect, -abs(foveaDist));
+		gl_Position = vec4(corner - jitter, 0, 1);
+	}
+}
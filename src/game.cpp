@@ -1,12 +1,35 @@
 #include "graphics.h"
 #include "game.h"
 #include "bmath.hpp"
+#include <algorithm>
+#include <unordered_map>
+#include <string.h>
+#include <limits.h>
 
 enum GameMode {
 	PlayMode,
 	BuildMode
 };
 
+// Each quality level is a different specialized variant of the ray tracing shader.
+enum Quality {
+	HighQuality,
+	MediumQuality,
+	LowQuality,
+	NumQualityLevels
+};
+
+// The ray tracing shader is also specialized for the different jobs it does, see 'loadRaytraceShader'.
+enum RaytraceVariant {
+	FullRaytrace,
+	PrimarySurfaces,
+	SecondaryLighting,
+	PortalView,
+	EdgeSupersampling,
+	IrradianceUpdate,
+	MultiView
+};
+
 struct Ray {
 	vec3 pos;
 	vec3 dir;
@@ -41,33 +64,293 @@ struct Voxel {
 	uint material;
 };
 
+// Voxels are traced as boxes of neighboring voxels with the same material, see 'mergeVoxelChunk'.
+// The low 16 bits of 'material' are the material index, and bits 16 to 21 say which of the 6 faces
+// of the box have at least one voxel face that isn't covered by another voxel, in the order
+// -X, +X, -Y, +Y, -Z, +Z. The irradiance cache entries of the box start at 'irradianceOffset'.
+struct Box {
+	alignas(sizeof(vec4)) ivec3 pos;
+	uint material;
+	alignas(sizeof(vec4)) ivec3 size;
+	uint irradianceOffset;
+};
+
 struct Portal {
 	alignas(sizeof(vec4)) vec3 pos;
 	alignas(sizeof(vec4)) vec3 normal;
 	float radius;
 };
 
+// Teleports anything entering a portal out of its pair portal.
+struct PortalLink {
+	mat4 transform;
+};
+
 static const float jumpVelocity = 10;
 static const float gravity = 40.0f;
 static const float playerHeight = 0.9f;
 static const float floatMax = 3.402823466e+38;
 static const float rayEpsilon = 0.001f;
 static const float PI = 3.141592741f;
+static const uint maxClusterGridDim = 16;
+static const uint coneTileSize = 8;
+static const uint foveaTileSize = 8;
+static const uint irradianceUpdateBudget = 256;
+static const int voxelChunkSize = 16;
+
+// The performance settings can be changed in the config file without recompiling, see 'readConfig'.
+// The file is read at startup and again whenever it changes, and the changes are applied right away.
+static const char *configFile = "config.txt";
+static uint raytraceWidth = 256;
+static uint raytraceHeight = 256;
+static uint frameRaysPerPixel = 5; // How many ray segments each frame can trace per pixel of the ray target.
+static float lightCutoffRadius = 0.001f;
+// Larger values in the config file are clamped to these, which also keeps the frame's ray budget from overflowing.
+static const uint maxRaytraceSize = 2048;
+static const uint maxRaysPerPixel = 64;
+static bool vsync = true;
+
+// Turning the painting effect on and its number of layers are baked into the paint shader.
+static bool painting = false;
+static float paintQuality = 0.85f;
+static uint paintLayers = 11;
+
+// The settings that something has to be recreated for when they change, see 'applySettings'.
+struct Settings {
+	uint raytraceWidth, raytraceHeight;
+	uint bounces[NumQualityLevels];
+	uint portalRecursion[NumQualityLevels];
+	float lightCutoffRadius;
+	float foveaRadius;
+	bool painting;
+	uint paintLayers;
+};
+
+// The first time the game runs, the auto-tuner renders a fixed camera path with each of the candidate
+// settings in turn, from the best looking to the cheapest, and picks the first one whose frames take
+// less than 'targetFrameTime'. The picked settings are written to 'tuneCacheFile' and read on top of
+// the config file on later runs. Delete it to tune again.
+struct TuneCandidate {
+	uint raytraceSize;
+	uint bounces; // For the high quality level, the lower levels never bounce more than once.
+	float paintQuality; // Only tuned when the painting is on, otherwise it isn't measured at all.
+};
+static const TuneCandidate tuneCandidates[] = {
+	{ 384, 2, 0.85f },
+	{ 320, 2, 0.85f },
+	{ 256, 2, 0.85f },
+	{ 256, 1, 0.85f },
+	{ 192, 1, 0.7f },
+	{ 128, 1, 0.7f },
+	{ 128, 0, 0.5f },
+	{ 96, 0, 0.5f },
+	{ 64, 0, 0.5f },
+};
+static const char *tuneCacheFile = "autotune.txt";
+static const uint tuneWarmupFrames = 5; // Skips the shader compilation and covers the latency of the GPU timers.
+static const uint tuneMeasureFrames = 8;
+static const vec3 tunePathCenter = vec3(0, 8, 0); // The camera turns around once here, looking down a bit.
+static bool autoTune = true;
+static float targetFrameTime = 16.7f; // In milliseconds.
+static bool tuning;
+static uint tuneCandidate;
+static uint tuneFrame;
+static double tuneFrameTime; // Sum of the measured frame times of the current candidate.
+static vec3 tuneSavedCameraPos;
+static float tuneSavedCameraPitch, tuneSavedCameraYaw;
+
+// Bounce and portal recursion limits of each quality level. The ray budget can lower these every frame.
+static uint qualityBounces[NumQualityLevels] = { 2, 1, 0 };
+static uint qualityPortalRecursion[NumQualityLevels] = { 4, 2, 1 };
 
 static GLFWwindow* window;
 static Shader raytraceShader;
 static Shader paintShader;
+static Shader reprojectShader;
 static GpuBuffer fullscreenQuad;
 static TextureArray textureAtlas;
 static GpuSyncedList<Light> lights;
 static GpuSyncedList<Material> materials;
 static GpuSyncedList<Plane> planes;
 static GpuSyncedList<Sphere> spheres;
-static GpuSyncedList<Voxel> voxels;
+static GpuSyncedList<Box> boxes;
 static GpuSyncedList<Portal> portals;
-static uint raytraceOutputFramebuffer;
+static GpuSyncedList<PortalLink> portalLinks;
 static uint fullscreenQuadVAO;
-static Texture raytraceOutputTexture;
+
+// The material of every voxel in the scene, keyed by position, see 'getVoxelKey'. The boxes are
+// merged from these in chunks of 'voxelChunkSize' cubed voxels, and editing a voxel only marks
+// the chunks around it dirty so that they are merged again before the next frame.
+static std::unordered_map<uint64_t, uint> voxelMaterials;
+static std::vector<ivec3> dirtyVoxelChunks;
+
+// The output of the reprojection pass is what gets displayed, and it also becomes the history
+// for the next frame, so we need 2 of them that we alternate between. These persist between
+// frames so they live outside of the render graph, all of the other render targets are transient.
+static Texture reprojectOutputTextures[2];
+static Texture reprojectDistanceTextures[2];
+
+// The visibility buffer stores the ID of the object visible at each pixel of the ray target.
+// It is filled by rasterizing the scene, and the ray tracer then doesn't have to search
+// the whole scene for the primary hits. See 'visvert.glsl'.
+static bool useVisibilityBuffer;
+static Shader visibilityShader;
+static Shader visibilityVoxelShader;
+
+// The cone pre-pass traces one cone per tile of the ray target to find how far the
+// primary rays of the tile can skip ahead before they could hit anything.
+static Shader coneShader;
+
+// Foveated tracing traces every pixel in the middle of the screen where the crosshair is,
+// and fewer and fewer pixels towards the edges. The traced pixels are listed in 'foveaSamples'
+// and are packed together in the ray tracing output, and the upsampling pass then fills in the
+// full ray target from them.
+static bool foveated;
+static float foveaRadius = 0.3f; // Radius of the full detail region, relative to the ray target.
+static std::vector<uint> foveaSamples;
+static std::vector<uvec2> foveaTiles;
+static GpuBuffer foveaSamplesBuffer;
+static GpuBuffer foveaTilesBuffer;
+static Shader upsampleShader;
+
+// Each frame the number of rays traced per pixel and the recursion limit of each
+// portal are chosen based on how much of the screen the portals cover.
+static GpuBuffer portalRecursionLimitsBuffer;
+static std::vector<uint> portalRecursionLimits;
+static uint rayBudget;
+
+// The voxel face that an irradiance cache entry is for.
+struct IrradianceEntry {
+	alignas(sizeof(vec4)) vec3 pos; // Center of the face.
+	uint index;
+	alignas(sizeof(vec4)) vec3 normal;
+	uint exposed; // 0 if the face is covered by another voxel, and can never be hit.
+};
+
+// The irradiance cache stores the diffuse light reaching the center of each voxel face. Bounces
+// off of voxels read it instead of evaluating every light with a shadow ray, and a compute pass
+// refreshes the 'irradianceUpdateBudget' stalest entries each frame. Entries near the camera and
+// near lights that moved go stale faster. See 'getCachedIrradiance' in the ray tracing shader.
+static bool useIrradianceCache = true;
+static Shader irradianceUpdateShader;
+static GpuBuffer irradianceCacheBuffer;
+static GpuBuffer irradianceUpdatesBuffer;
+static std::vector<IrradianceEntry> irradianceEntries;
+static std::vector<IrradianceEntry> irradianceUpdates;
+static std::vector<uint> irradianceUpdateFrames; // When each entry was last refreshed, 0 if it never was.
+static std::vector<std::pair<float, uint>> irradiancePriorities;
+static std::vector<vec3> prevLightPositions;
+static std::vector<float> clusterMovedLightWeights; // How much faster the entries in each light cluster go stale.
+
+// In many-light mode each shading point resamples a few random candidate lights and only traces a
+// shadow ray to the one it picks, so the cost per pixel doesn't grow with the number of lights.
+// The picks of the primary hits are kept in a reservoir per pixel for the next frame to reuse,
+// so we need 2 reservoir buffers that we alternate between. See 'getSampledLight' in the ray tracing shader.
+static bool useManyLights;
+static GpuBuffer reservoirBuffers[2];
+
+// In mixed resolution mode only the primary surfaces are found at the full resolution of the ray target,
+// their lighting and reflections are traced at 1/'secondaryScale' of it, and the upsampling pass then
+// combines the two while respecting the edges of the primary surfaces. A scale of 1 turns this off.
+static uint secondaryScale = 1;
+static Shader primarySurfaceShader;
+static Shader secondaryLightingShader;
+static Shader mixedResolutionShader;
+
+// With portal textures the view through each portal is rendered once per frame at 1/'portalViewScale' of
+// the ray target resolution, only where the portal is on screen, and primary rays that hit a portal read
+// it from there. Rays that hit a portal inside of a portal view read the previous frame's views, so the
+// recursion costs nothing. The views persist between frames so we need 2 of them that we alternate between.
+static const uint portalViewScale = 2;
+static bool usePortalTextures;
+static Shader portalViewShader;
+static Texture portalViewTextures[2];
+static vec4 portalFootprints[2]; // Screen space bounds of each portal as min x, min y, max x, max y in NDC.
+
+// Edge supersampling finds the pixels on silhouettes and material edges after the ray tracing pass,
+// and traces up to 4 more jittered samples for each of them. All of the edge pixels together get
+// 'edgeSampleBudget' extra samples each frame, so the cost doesn't depend on how busy the view is.
+// Each sample traces as many segments as a pixel, so the samples count against 'frameRaysPerPixel' too.
+static uint edgeSampleBudget; // One for every 8 pixels of the ray target.
+static bool useEdgeSupersampling;
+static Shader edgeShader;
+static Shader edgeSupersampleShader;
+static GpuBuffer edgePixelsBuffer; // How many edge pixels were found this frame.
+
+// Tile binning sorts the spheres and boxes into a list for each 'binTileSize' squared tile of the ray target,
+// of the ones that the primary rays of the tile could hit. The primary rays then only test their own tile's
+// list, while all of the other rays still test the whole scene. See 'bincomp.glsl'.
+static const uint binTileSize = 16;
+static uint numBinTiles;
+static const uint binTileCapacity = 128; // The primary rays of tiles with more primitives than this test the whole scene.
+static bool useTileBinning = true;
+static Shader binShader;
+static GpuBuffer tilePrimitivesBuffer;
+
+// The denoiser filters the light reaching the primary hits, which is noisy in many-light mode since each pixel
+// only traces one shadow ray. The light is accumulated over time, and then filtered with 'numDenoiseSteps' steps
+// of an edge-avoiding a-trous filter before the reprojection pass. The accumulated light persists between frames
+// so we need 2 of each history texture that we alternate between. See 'denoisefrag.glsl'.
+static const uint numDenoiseSteps = 5;
+static bool useDenoiser = true;
+static bool denoiseHistoryValid; // Whether the last traced frame was denoised.
+static Shader denoiseTemporalShader;
+static Shader denoiseFilterShader;
+static Texture denoiseHistoryTextures[2];
+static Texture denoiseMomentsTextures[2];
+
+// In stereo and split-screen mode the window is split into 2 views side by side, and so is the ray target.
+// Both views are traced in the same pass by the MULTI_VIEW variant of the ray tracing shader, so they share
+// the light clusters, the irradiance cache and everything else that is built once per frame, and the second
+// view only costs its own rays. Stereo views are the player's eyes, and the split-screen view is a second
+// camera that stays where the player was when split-screen was turned on.
+enum ViewMode {
+	SingleView,
+	StereoViews,
+	SplitScreenViews,
+	NumViewModes
+};
+static const uint maxViews = 2; // Must match the ray tracing shader.
+static const float eyeSeparation = 0.06f;
+static ViewMode viewMode = SingleView;
+static vec3 splitScreenCameraPos;
+static vec3 splitScreenCameraDir;
+static Shader multiViewShader;
+static GpuBuffer viewsBuffer;
+
+// With GPU picking the ray tracing pass also traces the ray through the crosshair, through the portals,
+// and writes what it hit to a small buffer. The mouse buttons use the last one that was read back instead
+// of tracing the ray on the CPU. Each frame writes to the next of 'numPickBuffers' buffers and puts a fence
+// after it, and a buffer is only read back once its fence has signaled so that reading it never stalls.
+struct Pick {
+	vec4 pos; // Where the ray hit, and 1 in the w if it hit anything.
+	vec4 normal;
+	uint primitive; // The type in the top 4 bits and the index in the rest, see 'makePrimitiveId' in the ray tracing shader.
+	uint padding[3];
+};
+static const uint numPickBuffers = 3;
+static const uint voxelPrimitiveType = 3; // Must match the ray tracing shader.
+static bool useGpuPicking = true;
+static GpuBuffer pickBuffers[numPickBuffers];
+static GLsync pickFences[numPickBuffers];
+static uint pickFrames[numPickBuffers]; // The frame that each buffer was written by.
+static Pick latestPick;
+static bool hasPick;
+static uint latestPickFrame;
+static uint minPickFrame; // Picks from before the scene last changed are out of date.
+
+// Same layout as the 'VIEWS' uniform block in the ray tracing shader, which is std140.
+struct GpuView {
+	vec4 cameraPos; // The fovea distance is in the w.
+	vec4 invView[3]; // Columns of the inverse view matrix, each padded to a vec4.
+};
+struct GpuViews {
+	vec2 resolution;
+	vec2 targetSize;
+	uint numViews;
+	uint padding[3];
+	GpuView views[maxViews];
+};
 
 static double cursorX, cursorY;
 static vec3 cameraPos = vec3(0, 10, 0);
@@ -80,8 +363,43 @@ static float cameraYaw;
 static float velocityY = 0;
 static bool doubleJumpReady = true;
 static GameMode gameMode = PlayMode;
+static Quality quality = HighQuality;
 static uint material = 2;
-static Light lightBuffer[100];
+static std::vector<Light> lightBuffer;
+
+// Lights are binned into a world space grid of clusters every frame. Each
+// cluster stores a range of indices into 'clusterLights', and the shader
+// only evaluates the lights in the range of the cluster a point falls in.
+static GpuBuffer lightClustersBuffer;
+static GpuBuffer clusterLightsBuffer;
+static std::vector<uvec2> lightClusters;
+static std::vector<uint> clusterLights;
+static vec3 clusterGridMin;
+static vec3 clusterCellSize;
+static uvec3 clusterGridDims;
+
+// Interleaved ray tracing only traces 1 out of every 'interleave' pixels each frame,
+// the rest of the pixels are reprojected from the previous frame.
+static uint interleave = 1;
+static uint frameIndex;
+static bool historyValid;
+static vec3 prevCameraPos;
+static mat3 prevInvView;
+static float prevFoveaDist;
+static int prevWidth, prevHeight;
+
+// When nothing that affects the image changed since the last frame, the frame is spent on tracing
+// another jittered sample of every pixel and averaging it with the previous ones instead. After
+// 'maxAccumulatedFrames' samples the image is as good as it gets, and the last image is reused
+// without tracing anything until something changes.
+static const uint maxAccumulatedFrames = 16;
+static uint64_t prevFrameHash;
+static uint staticFrames; // How many frames in a row nothing changed.
+
+// The light and portal animations can be paused, which is needed for the view to ever be static.
+static bool animationPaused;
+static double animationTime;
+static double pausedTime; // How long the animations have been paused in total.
 
 //
 // Functions below were almost exactly copy pasted
@@ -99,6 +417,32 @@ static mat3 getPortalMatrix(Portal portal) {
 	return transpose(mat3(t, b, n));
 }
 
+// Get the transform that teleports from portal 'in' to portal 'out'. We first transform
+// from "world space" to "portal in space", then we pretend these "portal in coordinates"
+// are actually "portal out coordinates" and undo the "portal out space" transformation.
+// This effectively teleports from one portal to the other and keeps the relative
+// direction intact. Since we go INTO one portal and OUT of the other, one of the
+// portal normals has to be flipped.
+static PortalLink getPortalLink(Portal in, Portal out) {
+	in.normal = -in.normal;
+	mat3 M = inverse(getPortalMatrix(out)) * getPortalMatrix(in);
+	PortalLink link;
+	link.transform = mat4(M);
+	link.transform.col[3] = vec4(out.pos - M * in.pos, 1);
+	return link;
+}
+
+// Recompute the portal links, this needs to be done whenever a portal is placed.
+static void updatePortalLinks() {
+	for (size_t i = 0; i < 2; ++i) {
+		PortalLink link = getPortalLink(portals[i], portals[1 - i]);
+		if (i < portalLinks.length())
+			portalLinks[i] = link;
+		else
+			portalLinks.push(link);
+	}
+}
+
 static float intersect(Ray r, Plane p) {
 	const float epsilon = 0.001;
 	float denom = dot(r.dir, p.normal);
@@ -121,7 +465,7 @@ static float intersect(Ray r, Sphere s) {
 		return (float)-0.5 * (b + sqrt(discriminant));
 }
 
-static float intersect(Ray r, Voxel v) {
+static float intersect(Ray r, Box b) {
 	// If the ray direction is 0, we will divide by 0!
 	// correct this case if it happens..
 	const float epsilon = 0.001;
@@ -130,8 +474,8 @@ static float intersect(Ray r, Voxel v) {
 	if (r.dir.z == 0) r.dir.z = epsilon;
 	
 	vec3 invDir = 1.0f / r.dir;
-	vec3 ld = (vec3(v.pos) - r.pos) * invDir;
-	vec3 rd = (vec3(v.pos) - r.pos) * invDir + invDir;
+	vec3 ld = (vec3(b.pos) - r.pos) * invDir;
+	vec3 rd = (vec3(b.pos) - r.pos) * invDir + vec3(b.size) * invDir;
 	vec3 mind = min(ld, rd);
 	vec3 maxd = max(ld, rd);
 	float dmin = max(max(mind.x, mind.y), mind.z);
@@ -139,8 +483,18 @@ static float intersect(Ray r, Voxel v) {
 
 	if (dmin > dmax)
 		return floatMax;
-	else
+	if (dmin <= 0)
 		return dmin;
+
+	// A ray can't get in through a face that is covered by other voxels, it would hit those first.
+	// Near edges the ray might be entering through either face, so it only has to be one of them.
+	uint exposedFaces = b.material >> 16;
+	for (int axis = 0; axis < 3; ++axis) {
+		int face = 2 * axis + (r.dir[axis] > 0 ? 0 : 1);
+		if (mind[axis] >= dmin - rayEpsilon && (exposedFaces >> face & 1))
+			return dmin;
+	}
+	return floatMax;
 }
 
 static float intersect(Ray r, Portal p) {
@@ -184,13 +538,18 @@ static Ray trace(Ray ray) {
 		}
 	}
 
-	for (uint i = 0; i < voxels.length(); ++i) {
-		Voxel voxel = voxels[i];
-		float d = intersect(ray, voxel);
+	for (uint i = 0; i < boxes.length(); ++i) {
+		Box box = boxes[i];
+		float d = intersect(ray, box);
 		if (d > 0 && d < hitDist) {
 			hitDist = d;
 			vec3 hitPos = ray.pos + ray.dir * hitDist;
-			hitNormal = normalize(vec3(ivec3(2.0001f * (hitPos - vec3(voxel.pos) - 0.5f))));
+			vec3 halfSize = 0.5f * vec3(box.size);
+			vec3 n = (hitPos - vec3(box.pos) - halfSize) / halfSize;
+			vec3 a = vec3(abs(n.x), abs(n.y), abs(n.z));
+			int axis = a.x > a.y && a.x > a.z ? 0 : a.y > a.z ? 1 : 2;
+			hitNormal = vec3(0);
+			hitNormal[axis] = n[axis] > 0 ? 1.0f : -1.0f;
 		}
 	}
 
@@ -209,6 +568,490 @@ static int getClosestPortal(vec3 pos) {
 		return 1;
 }
 
+// Bin all the lights into a world space grid of clusters based on how far each light reaches.
+// The grid is fitted around the region reached by the lights, so any point outside of it
+// is out of reach of every light.
+static void buildLightClusters() {
+	// A light is cut off when its attenuation 1/d^2 drops below the cutoff. At the default cutoff that's
+	// about 32 units, as big as this whole scene, so the clusters in the scene still hold about 22 of its
+	// 24 lights and barely cull anything. They pay off in scenes much bigger than the light radius, or
+	// with a higher 'light_cutoff': at 0.01 the radius is 10 units and those clusters hold about 7 lights.
+	float lightRadius = 1 / sqrt(lightCutoffRadius);
+
+	vec3 gridMin = vec3(floatMax);
+	vec3 gridMax = vec3(-floatMax);
+	for (size_t i = 0; i < lights.length(); ++i) {
+		Light light = lights[i];
+		gridMin = min(gridMin, light.pos - lightRadius);
+		gridMax = max(gridMax, light.pos + lightRadius);
+	}
+
+	lightClusters.clear();
+	clusterLights.clear();
+	clusterGridDims = uvec3(0);
+	if (lights.length() > 0) {
+		// Use roughly cube shaped cells, with at most 'maxClusterGridDim' cells along the longest axis.
+		vec3 extent = gridMax - gridMin;
+		float cellSize = max(max(extent.x, extent.y), extent.z) / maxClusterGridDim;
+		clusterGridDims = uvec3(max(vec3(1), ceil(extent / cellSize)));
+		clusterGridMin = gridMin;
+		clusterCellSize = extent / vec3(clusterGridDims);
+
+		uint numClusters = clusterGridDims.x * clusterGridDims.y * clusterGridDims.z;
+		lightClusters.resize(numClusters, uvec2(0));
+		for (uint z = 0; z < clusterGridDims.z; ++z)
+		for (uint y = 0; y < clusterGridDims.y; ++y)
+		for (uint x = 0; x < clusterGridDims.x; ++x) {
+			vec3 cellMin = clusterGridMin + vec3(uvec3(x, y, z)) * clusterCellSize;
+			vec3 cellMax = cellMin + clusterCellSize;
+			uvec2 &cluster = lightClusters[x + clusterGridDims.x * (y + clusterGridDims.y * z)];
+			cluster.x = (uint)clusterLights.size();
+			for (size_t i = 0; i < lights.length(); ++i) {
+				// Sphere-box overlap test.
+				Light light = lights[i];
+				vec3 closest = clamp(light.pos, cellMin, cellMax);
+				vec3 d = closest - light.pos;
+				if (dot(d, d) < lightRadius * lightRadius)
+					clusterLights.push_back((uint)i);
+			}
+			cluster.y = (uint)clusterLights.size() - cluster.x;
+		}
+	}
+
+	// Buffers can't be empty, so there is always at least 1 item in them.
+	if (lightClusters.empty()) lightClusters.push_back(uvec2(0));
+	if (clusterLights.empty()) clusterLights.push_back(0);
+	recreateGpuBuffer(lightClustersBuffer, lightClusters.data(), lightClusters.size() * sizeof(uvec2));
+	recreateGpuBuffer(clusterLightsBuffer, clusterLights.data(), clusterLights.size() * sizeof(uint));
+}
+
+// Choose how densely each tile of the ray target is traced for foveated tracing, and list
+// the pixels that are traced. Each ring of tiles that is 'foveaRadius' wide traces 1/4
+// of the pixels of the ring inside of it, down to 1 pixel in each 8x8 block.
+static void buildFoveaSamples() {
+	uvec2 numTiles = uvec2(raytraceWidth, raytraceHeight) / foveaTileSize;
+	foveaSamples.clear();
+	foveaTiles.clear();
+	for (uint ty = 0; ty < numTiles.y; ++ty) {
+		for (uint tx = 0; tx < numTiles.x; ++tx) {
+			vec2 center = 2.0f * (vec2((float)tx, (float)ty) + 0.5f) / vec2(numTiles) - 1.0f;
+			uint ring = min(3u, (uint)(length(center) / foveaRadius));
+			uint blockSize = 1u << ring;
+			foveaTiles.push_back(uvec2((uint)foveaSamples.size(), blockSize));
+			for (uint y = 0; y < foveaTileSize; y += blockSize) {
+				for (uint x = 0; x < foveaTileSize; x += blockSize) {
+					uint px = tx * foveaTileSize + x;
+					uint py = ty * foveaTileSize + y;
+					foveaSamples.push_back(px | (py << 16));
+				}
+			}
+		}
+	}
+	recreateGpuBuffer(foveaSamplesBuffer, foveaSamples.data(), foveaSamples.size() * sizeof(uint));
+	recreateGpuBuffer(foveaTilesBuffer, foveaTiles.data(), foveaTiles.size() * sizeof(uvec2));
+}
+
+// Estimate how many pixels each portal covers on screen from its projected disk, and choose
+// how deep the recursive views through each portal go. Each time we look through the portal
+// pair the view gets further away and smaller, so the recursion stops once it's under a pixel.
+// Then choose how many ray segments each pixel can trace so that the whole frame stays within
+// 'frameRaysPerPixel' on average, taking the portals into account.
+static void updateRayBudget(mat3 invView, int width, int height, uint numTracedPixels) {
+	vec2 aspect = vec2(
+		max((float)width / (float)height, 1.0f),
+		max((float)height / (float)width, 1.0f));
+	uint maxBounces = qualityBounces[quality];
+	uint maxRecursion = qualityPortalRecursion[quality];
+	uint frameRayBudget = frameRaysPerPixel * raytraceWidth * raytraceHeight;
+
+	portalRecursionLimits.resize(portals.length());
+	float coverages[2] = {};
+	assert(portals.length() <= 2);
+	for (size_t i = 0; i < portals.length(); ++i) {
+		Portal portal = portals[i];
+		vec3 v = portal.pos - cameraPos;
+		float dist = length(v);
+		float depth = -dot(v, invView[2]);
+		float coverage = 0;
+		float radiusPixels = 0;
+		portalFootprints[i] = vec4(1, 1, -1, -1);
+		if (dist <= portal.radius) {
+			// We're right up against the portal so it covers the whole screen.
+			coverage = 1;
+			radiusPixels = (float)raytraceWidth;
+			portalFootprints[i] = vec4(-1, -1, 1, 1);
+		}
+		else if (depth > -portal.radius) {
+			float scale = cameraFoveaDist / max(depth, 0.01f);
+			vec2 center = vec2(dot(v, invView[0]), dot(v, invView[1])) * scale / aspect;
+			vec2 radius = portal.radius * scale / aspect;
+			if (abs(center.x) < 1 + radius.x && abs(center.y) < 1 + radius.y) {
+				float facing = abs(dot(portal.normal, v)) / dist;
+				coverage = min(1.0f, 0.25f * PI * radius.x * radius.y * facing);
+				radiusPixels = 0.5f * max(radius.x * raytraceWidth, radius.y * raytraceHeight);
+
+				// The near side of the portal can be up to a radius closer than its center,
+				// so bound each side of it by its projection at the nearest possible depth.
+				float nearDepth = depth - portal.radius;
+				float farDepth = depth + portal.radius;
+				portalFootprints[i] = vec4(-1, -1, 1, 1);
+				if (nearDepth > 0.01f) {
+					vec2 low = vec2(dot(v, invView[0]), dot(v, invView[1])) - portal.radius;
+					vec2 high = vec2(dot(v, invView[0]), dot(v, invView[1])) + portal.radius;
+					portalFootprints[i] = vec4(
+						max(-1.0f, low.x / (low.x < 0 ? nearDepth : farDepth) * cameraFoveaDist / aspect.x),
+						max(-1.0f, low.y / (low.y < 0 ? nearDepth : farDepth) * cameraFoveaDist / aspect.y),
+						min(1.0f, high.x / (high.x > 0 ? nearDepth : farDepth) * cameraFoveaDist / aspect.x),
+						min(1.0f, high.y / (high.y > 0 ? nearDepth : farDepth) * cameraFoveaDist / aspect.y));
+				}
+			}
+		}
+
+		// The portals are a fixed pair, so each level of recursion is seen from
+		// further away by about the distance between the portals.
+		Portal pair = portals[1 - i];
+		float separation = distance(portal.pos, pair.pos);
+		float shrink = dist / (dist + separation);
+		uint limit = 1;
+		while (limit < maxRecursion && radiusPixels * pow(shrink, (float)limit) >= 1)
+			++limit;
+		portalRecursionLimits[i] = limit;
+		coverages[i] = coverage;
+	}
+
+	// Every pixel traces its primary ray and then up to 'rayBudget' more segments. Use the
+	// largest budget that fits, but always allow at least one trip through a portal.
+	uint maxBudget = maxBounces + maxRecursion;
+	rayBudget = 1;
+	for (uint budget = maxBudget; budget > 1; --budget) {
+		float raysPerPixel = 1 + (float)min(budget, maxBounces);
+		for (size_t i = 0; i < portals.length(); ++i)
+			raysPerPixel += coverages[i] * (float)min(budget, portalRecursionLimits[i]);
+		if (raysPerPixel * (float)numTracedPixels <= (float)frameRayBudget) {
+			rayBudget = budget;
+			break;
+		}
+	}
+	recreateGpuBuffer(portalRecursionLimitsBuffer, portalRecursionLimits.data(), portalRecursionLimits.size() * sizeof(uint));
+}
+
+// Throw away all of the cached irradiance, it is recomputed over the next few frames.
+// This has to be called whenever the scene changes in a way that changes the lighting.
+static void invalidateIrradianceCache() {
+	irradianceUpdateFrames.clear();
+}
+
+// Pack a voxel position into a key for 'voxelMaterials'.
+static uint64_t getVoxelKey(ivec3 pos) {
+	return ((uint64_t)(pos.x & 0x1FFFFF) << 42) | ((uint64_t)(pos.y & 0x1FFFFF) << 21) | (uint64_t)(pos.z & 0x1FFFFF);
+}
+
+// Get which faces of the voxel at the given position aren't covered by a neighboring voxel,
+// as a bit for each face in the order -X, +X, -Y, +Y, -Z, +Z.
+static uint getExposedFaces(ivec3 pos) {
+	uint faces = 0;
+	for (int i = 0; i < 6; ++i) {
+		ivec3 neighbor = pos;
+		neighbor[i / 2] += i % 2 ? 1 : -1;
+		if (voxelMaterials.find(getVoxelKey(neighbor)) == voxelMaterials.end())
+			faces |= 1u << i;
+	}
+	return faces;
+}
+
+// Get the chunk that the voxel at the given position is merged in.
+static ivec3 getVoxelChunk(ivec3 pos) {
+	ivec3 chunk;
+	for (int i = 0; i < 3; ++i)
+		chunk[i] = (pos[i] < 0 ? pos[i] - voxelChunkSize + 1 : pos[i]) / voxelChunkSize;
+	return chunk;
+}
+
+// Mark the chunks that a voxel at the given position and its neighbors are in as dirty. The
+// neighbors can be in other chunks, and whether their faces are covered changes with the voxel.
+static void markVoxelChunksDirty(ivec3 pos) {
+	for (int i = 0; i < 7; ++i) {
+		ivec3 neighbor = pos;
+		if (i < 6) neighbor[i / 2] += i % 2 ? 1 : -1;
+		ivec3 chunk = getVoxelChunk(neighbor);
+		if (std::none_of(dirtyVoxelChunks.begin(), dirtyVoxelChunks.end(), [=](ivec3 c) { return all(c == chunk); }))
+			dirtyVoxelChunks.push_back(chunk);
+	}
+}
+
+// Add or replace a voxel.
+static void addVoxel(Voxel voxel) {
+	voxelMaterials[getVoxelKey(voxel.pos)] = voxel.material;
+	markVoxelChunksDirty(voxel.pos);
+}
+
+// Remove the voxel at the given position.
+static void removeVoxel(ivec3 pos) {
+	voxelMaterials.erase(getVoxelKey(pos));
+	markVoxelChunksDirty(pos);
+}
+
+// Greedily merge the voxels of a chunk into boxes. Starting from each voxel that isn't in a box yet,
+// the box grows along X as far as the material stays the same, then along Y one row at a time and
+// along Z one slab at a time for as long as the whole row or slab matches. Voxels that are covered on
+// all sides are merged as well since they make the boxes bigger, but boxes that are completely
+// covered are left out.
+static void mergeVoxelChunk(ivec3 chunk) {
+	const int n = voxelChunkSize;
+	ivec3 origin = chunk * n;
+	std::vector<int> cells(n * n * n, -1); // Material of each voxel that isn't in a box yet, or -1.
+	auto cell = [&](int x, int y, int z) -> int & { return cells[(z * n + y) * n + x]; };
+	for (int z = 0; z < n; ++z) {
+		for (int y = 0; y < n; ++y) {
+			for (int x = 0; x < n; ++x) {
+				auto it = voxelMaterials.find(getVoxelKey(origin + ivec3(x, y, z)));
+				if (it != voxelMaterials.end())
+					cell(x, y, z) = (int)it->second;
+			}
+		}
+	}
+
+	for (int z = 0; z < n; ++z) {
+		for (int y = 0; y < n; ++y) {
+			for (int x = 0; x < n; ++x) {
+				int material = cell(x, y, z);
+				if (material < 0)
+					continue;
+
+				ivec3 size = ivec3(1);
+				auto matches = [&](int x0, int x1, int y0, int y1, int z0, int z1) {
+					for (int k = z0; k < z1; ++k)
+						for (int j = y0; j < y1; ++j)
+							for (int i = x0; i < x1; ++i)
+								if (cell(i, j, k) != material) return false;
+					return true;
+				};
+				while (x + size.x < n && cell(x + size.x, y, z) == material)
+					++size.x;
+				while (y + size.y < n && matches(x, x + size.x, y + size.y, y + size.y + 1, z, z + 1))
+					++size.y;
+				while (z + size.z < n && matches(x, x + size.x, y, y + size.y, z + size.z, z + size.z + 1))
+					++size.z;
+
+				ivec3 pos = origin + ivec3(x, y, z);
+				uint faces = 0;
+				for (int k = 0; k < size.z; ++k) {
+					for (int j = 0; j < size.y; ++j) {
+						for (int i = 0; i < size.x; ++i) {
+							cell(x + i, y + j, z + k) = -1;
+							ivec3 local = ivec3(i, j, k);
+							uint exposed = getExposedFaces(pos + local);
+							for (int face = 0; face < 6; ++face) {
+								int axis = face / 2;
+								if (local[axis] == (face % 2 ? size[axis] - 1 : 0))
+									faces |= exposed & (1u << face);
+							}
+						}
+					}
+				}
+				if (faces != 0)
+					boxes.push({ pos, ((uint)material & 0xFFFF) | faces << 16, size, 0 });
+			}
+		}
+	}
+}
+
+// Merge the dirty chunks again, and lay out the irradiance cache entries of the boxes.
+static void updateVoxelBoxes() {
+	if (dirtyVoxelChunks.empty())
+		return;
+
+	// Take out the boxes of the dirty chunks, keeping the order of the rest.
+	size_t numKept = 0;
+	for (size_t i = 0; i < boxes.length(); ++i) {
+		Box box = boxes[i];
+		ivec3 chunk = getVoxelChunk(box.pos);
+		if (std::any_of(dirtyVoxelChunks.begin(), dirtyVoxelChunks.end(), [=](ivec3 c) { return all(c == chunk); }))
+			continue;
+		if (numKept != i)
+			boxes[numKept] = box;
+		++numKept;
+	}
+	while (boxes.length() > numKept)
+		boxes.pop();
+	for (ivec3 chunk : dirtyVoxelChunks)
+		mergeVoxelChunk(chunk);
+	dirtyVoxelChunks.clear();
+
+	// Each box has an entry for every voxel face on its surface, face by face in the order
+	// -X, +X, -Y, +Y, -Z, +Z, and row by row within each face. See 'getIrradianceEntry'.
+	irradianceEntries.clear();
+	for (size_t i = 0; i < boxes.length(); ++i) {
+		Box box = boxes[i];
+		if (box.irradianceOffset != irradianceEntries.size()) {
+			box.irradianceOffset = (uint)irradianceEntries.size();
+			boxes[i] = box;
+		}
+		for (int face = 0; face < 6; ++face) {
+			int axis = face / 2;
+			int u = (axis + 1) % 3;
+			int v = (axis + 2) % 3;
+			vec3 normal = vec3(0);
+			normal[axis] = face % 2 ? 1.0f : -1.0f;
+			for (int j = 0; j < box.size[v]; ++j) {
+				for (int i = 0; i < box.size[u]; ++i) {
+					ivec3 cell = box.pos;
+					cell[axis] += face % 2 ? box.size[axis] - 1 : 0;
+					cell[u] += i;
+					cell[v] += j;
+					IrradianceEntry entry;
+					entry.pos = vec3(cell) + 0.5f + 0.5f * normal;
+					entry.index = (uint)irradianceEntries.size();
+					entry.normal = normal;
+					entry.exposed = getExposedFaces(cell) >> face & 1;
+					irradianceEntries.push_back(entry);
+				}
+			}
+		}
+	}
+	invalidateIrradianceCache();
+}
+
+// Choose which irradiance cache entries to refresh this frame, and upload them to the GPU.
+static void updateIrradianceCache() {
+	size_t numEntries = irradianceEntries.size();
+	if (irradianceUpdateFrames.size() != numEntries) {
+		// The voxels changed, so the cache has to start over.
+		irradianceUpdateFrames.assign(numEntries, 0);
+		std::vector<vec4> emptyCache(max(numEntries, (size_t)1), vec4(0));
+		recreateGpuBuffer(irradianceCacheBuffer, emptyCache.data(), emptyCache.size() * sizeof(vec4));
+	}
+	prevLightPositions.resize(lights.length(), vec3(floatMax));
+
+	// Each light that just moved makes the entries within its reach go stale faster, the more the
+	// closer they are. That's added up per light cluster from the distance of each cluster's center
+	// to the light, so each entry only has to look up its own cluster. See 'buildLightClusters'.
+	float lightRadius = 1 / sqrt(lightCutoffRadius);
+	clusterMovedLightWeights.assign(lightClusters.size(), 0.0f);
+	for (size_t j = 0; j < lights.length(); ++j) {
+		Light light = lights[j];
+		float moved = min(distance(light.pos, prevLightPositions[j]), 1.0f);
+		prevLightPositions[j] = light.pos;
+		if (moved == 0 || clusterGridDims.x == 0)
+			continue;
+
+		uvec3 first = uvec3(clamp(floor((light.pos - lightRadius - clusterGridMin) / clusterCellSize), vec3(0), vec3(clusterGridDims - 1u)));
+		uvec3 last = uvec3(clamp(floor((light.pos + lightRadius - clusterGridMin) / clusterCellSize), vec3(0), vec3(clusterGridDims - 1u)));
+		for (uint z = first.z; z <= last.z; ++z)
+		for (uint y = first.y; y <= last.y; ++y)
+		for (uint x = first.x; x <= last.x; ++x) {
+			vec3 cellMin = clusterGridMin + vec3(uvec3(x, y, z)) * clusterCellSize;
+			if (lengthSq(clamp(light.pos, cellMin, cellMin + clusterCellSize) - light.pos) < lightRadius * lightRadius)
+				clusterMovedLightWeights[x + clusterGridDims.x * (y + clusterGridDims.y * z)] +=
+					64 * moved / (1 + lengthSq(cellMin + 0.5f * clusterCellSize - light.pos));
+		}
+	}
+
+	// Entries that were never computed go first, and after that the ones that have been
+	// stale the longest. Being close to the camera or to a light that just moved makes
+	// an entry go stale faster, since any change there is more noticeable.
+	uint updateFrame = frameIndex + 1;
+	irradiancePriorities.resize(numEntries);
+	for (size_t i = 0; i < numEntries; ++i) {
+		vec3 pos = irradianceEntries[i].pos;
+
+		// Faces that are covered by another voxel can never be hit, so they go last.
+		float priority = floatMax;
+		if (!irradianceEntries[i].exposed) {
+			priority = -1;
+		} else if (irradianceUpdateFrames[i] != 0) {
+			float weight = 1 + 64 / (16 + lengthSq(pos - cameraPos));
+			// Negative cells wrap around to past the end of the grid.
+			uvec3 cell = uvec3(ivec3(floor((pos - clusterGridMin) / clusterCellSize)));
+			if (cell.x < clusterGridDims.x && cell.y < clusterGridDims.y && cell.z < clusterGridDims.z)
+				weight += clusterMovedLightWeights[cell.x + clusterGridDims.x * (cell.y + clusterGridDims.y * cell.z)];
+			priority = (float)(updateFrame - irradianceUpdateFrames[i]) * weight;
+		}
+		irradiancePriorities[i] = std::make_pair(priority, (uint)i);
+	}
+
+	size_t numUpdates = min(numEntries, (size_t)irradianceUpdateBudget);
+	std::nth_element(irradiancePriorities.begin(), irradiancePriorities.begin() + (int)numUpdates, irradiancePriorities.end(),
+		[](const std::pair<float, uint> &a, const std::pair<float, uint> &b) { return a.first > b.first; });
+	irradianceUpdates.clear();
+	for (size_t i = 0; i < numUpdates; ++i) {
+		irradianceUpdates.push_back(irradianceEntries[irradiancePriorities[i].second]);
+		irradianceUpdateFrames[irradiancePriorities[i].second] = updateFrame;
+	}
+
+	// The buffer always has room for a whole budget of updates.
+	if (numUpdates > 0)
+		updateGpuBuffer(irradianceUpdatesBuffer, 0, irradianceUpdates.data(), numUpdates * sizeof(IrradianceEntry));
+}
+
+// Mix some bytes into an FNV-1a hash.
+static uint64_t hashBytes(uint64_t hash, const void *data, size_t size) {
+	const unsigned char *bytes = (const unsigned char *)data;
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+// Hash everything other than the scene objects that affects the rendered image.
+static uint64_t hashFrameState(int width, int height) {
+	uint64_t hash = 14695981039346656037ull;
+	hash = hashBytes(hash, &cameraPos, sizeof(cameraPos));
+	hash = hashBytes(hash, &cameraDir, sizeof(cameraDir));
+	hash = hashBytes(hash, &cameraFoveaDist, sizeof(cameraFoveaDist));
+	hash = hashBytes(hash, &animationTime, sizeof(animationTime));
+	hash = hashBytes(hash, &width, sizeof(width));
+	hash = hashBytes(hash, &height, sizeof(height));
+	hash = hashBytes(hash, &quality, sizeof(quality));
+	hash = hashBytes(hash, &interleave, sizeof(interleave));
+	hash = hashBytes(hash, &foveated, sizeof(foveated));
+	hash = hashBytes(hash, &foveaRadius, sizeof(foveaRadius));
+	hash = hashBytes(hash, &useVisibilityBuffer, sizeof(useVisibilityBuffer));
+	hash = hashBytes(hash, &useIrradianceCache, sizeof(useIrradianceCache));
+	hash = hashBytes(hash, &useManyLights, sizeof(useManyLights));
+	hash = hashBytes(hash, &secondaryScale, sizeof(secondaryScale));
+	hash = hashBytes(hash, &usePortalTextures, sizeof(usePortalTextures));
+	hash = hashBytes(hash, &useEdgeSupersampling, sizeof(useEdgeSupersampling));
+	hash = hashBytes(hash, &useDenoiser, sizeof(useDenoiser));
+	hash = hashBytes(hash, &viewMode, sizeof(viewMode));
+	hash = hashBytes(hash, &frameRaysPerPixel, sizeof(frameRaysPerPixel));
+	hash = hashBytes(hash, &lightCutoffRadius, sizeof(lightCutoffRadius));
+	hash = hashBytes(hash, qualityBounces, sizeof(qualityBounces));
+	hash = hashBytes(hash, qualityPortalRecursion, sizeof(qualityPortalRecursion));
+	return hash;
+}
+
+// Get the i'th point of the Halton sequence with the given base, which is in [0, 1).
+static float halton(uint i, uint base) {
+	float f = 1;
+	float result = 0;
+	while (i > 0) {
+		f /= (float)base;
+		result += f * (float)(i % base);
+		i /= base;
+	}
+	return result;
+}
+
+// Read back the newest pick whose fence has signaled, without waiting for any of the others.
+static void readPicks() {
+	for (uint i = 0; i < numPickBuffers; ++i) {
+		if (!pickFences[i])
+			continue;
+		GLenum status = glClientWaitSync(pickFences[i], 0, 0);
+		if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+			continue;
+		glDeleteSync(pickFences[i]);
+		pickFences[i] = 0;
+		if (pickFrames[i] < minPickFrame || (hasPick && pickFrames[i] < latestPickFrame))
+			continue;
+		readGpuBuffer(pickBuffers[i], 0, &latestPick, sizeof(latestPick));
+		latestPickFrame = pickFrames[i];
+		hasPick = true;
+	}
+}
+
 // Print the material that was picked to the user.
 static void printPickedMaterial() {
 	switch (material) {
@@ -244,6 +1087,62 @@ static vec3 moveWithCollisionCheck(vec3 from, vec3 dir, float epsilon=rayEpsilon
 	return from + min(dist, maxDist) * dir;
 }
 
+// Load the variant of the ray tracing shader for the current settings. The irradiance update variant
+// is a compute shader that refreshes the irradiance cache, see 'updateIrradianceCache'.
+static Shader loadRaytraceShader(RaytraceVariant variant = FullRaytrace) {
+	char numPlanes[32], numPortals[32], numBounces[32], portalRecursion[32];
+	sprintf(numPlanes, "NUM_PLANES %d", (int)planes.length());
+	sprintf(numPortals, "NUM_PORTALS %d", (int)portals.length());
+	sprintf(numBounces, "NUM_BOUNCES %d", (int)qualityBounces[quality]);
+	sprintf(portalRecursion, "PORTAL_RECURSION %d", (int)qualityPortalRecursion[quality]);
+	const char *defines[16] = { numPlanes, numPortals, numBounces, portalRecursion };
+	uint numDefines = 4;
+	if (quality == LowQuality)
+		defines[numDefines++] = "NO_SHADOWS";
+	if (variant == IrradianceUpdate) {
+		defines[numDefines++] = "IRRADIANCE_UPDATE";
+		return loadComputeShader("shaders/rayfrag.glsl", defines, numDefines);
+	}
+	if (variant == PrimarySurfaces)
+		defines[numDefines++] = "PRIMARY_SURFACES";
+	if (variant == SecondaryLighting)
+		defines[numDefines++] = "SECONDARY_LIGHTING";
+	if (variant == PortalView || (variant == FullRaytrace && usePortalTextures))
+		defines[numDefines++] = "PORTAL_TEXTURES";
+	if (variant == PortalView)
+		defines[numDefines++] = "PORTAL_VIEW";
+	if (variant == EdgeSupersampling)
+		defines[numDefines++] = "EDGE_SUPERSAMPLING";
+	if (variant == MultiView)
+		defines[numDefines++] = "MULTI_VIEW";
+	if (useGpuPicking && (variant == FullRaytrace || variant == PrimarySurfaces))
+		defines[numDefines++] = "PICKING";
+
+	// The tiles are binned for the full ray target from the main camera.
+	if (useTileBinning && (variant == FullRaytrace || variant == PrimarySurfaces))
+		defines[numDefines++] = "TILE_BINNING";
+
+	// The visibility buffer is only rasterized at the full resolution for the main camera, without any jitter.
+	if (useVisibilityBuffer && (variant == FullRaytrace || variant == PrimarySurfaces))
+		defines[numDefines++] = "VISIBILITY_BUFFER";
+	if (useIrradianceCache)
+		defines[numDefines++] = "CACHED_IRRADIANCE";
+	if (useManyLights)
+		defines[numDefines++] = "MANY_LIGHTS";
+	return loadShader("shaders/rayvert.glsl", "shaders/rayfrag.glsl", defines, numDefines);
+}
+
+// Reload all of the variants of the ray tracing shader after the settings changed.
+static void loadRaytraceShaders() {
+	raytraceShader = loadRaytraceShader();
+	primarySurfaceShader = loadRaytraceShader(PrimarySurfaces);
+	secondaryLightingShader = loadRaytraceShader(SecondaryLighting);
+	portalViewShader = loadRaytraceShader(PortalView);
+	edgeSupersampleShader = loadRaytraceShader(EdgeSupersampling);
+	multiViewShader = loadRaytraceShader(MultiView);
+	irradianceUpdateShader = loadRaytraceShader(IrradianceUpdate);
+}
+
 // This is machine generated code that loads the default scene.
 // At some point when you pressed the middle mouse button we would
 // generate the code below for all objects in the scene. We removed
@@ -295,258 +1194,261 @@ static void loadScene() {
 	spheres.push({ { -0.5, 0.1, -3 }, 0.5, 12 });
 	spheres.push({ { 0.5, 0.5, -4 }, 0.7, 11 });
 	spheres.push({ { 0.1, 0.3, -2 }, 0.3, 10 });
-	voxels.create(247);
-	voxels.push({ { -132, 0, 71 }, 7 });
-	voxels.push({ { -4, 0, -3 }, 2 });
-	voxels.push({ { -5, 0, -3 }, 2 });
-	voxels.push({ { -6, 0, -3 }, 2 });
-	voxels.push({ { -4, 0, -4 }, 2 });
-	voxels.push({ { -5, 0, -4 }, 2 });
-	voxels.push({ { -6, 0, -4 }, 2 });
-	voxels.push({ { -4, 0, -5 }, 2 });
-	voxels.push({ { -5, 0, -5 }, 2 });
-	voxels.push({ { -6, 0, -5 }, 2 });
-	voxels.push({ { -5, 1, -6 }, 4 });
-	voxels.push({ { -5, 3, -7 }, 4 });
-	voxels.push({ { -5, 2, -6 }, 4 });
-	voxels.push({ { -4, 1, -6 }, 4 });
-	voxels.push({ { -4, 2, -6 }, 4 });
-	voxels.push({ { -6, 1, -6 }, 4 });
-	voxels.push({ { -6, 2, -6 }, 4 });
-	voxels.push({ { -6, 3, -7 }, 4 });
-	voxels.push({ { -4, 3, -7 }, 4 });
-	voxels.push({ { -7, 3, -7 }, 4 });
-	voxels.push({ { -7, 0, -6 }, 4 });
-	voxels.push({ { -7, 1, -6 }, 4 });
-	voxels.push({ { -7, 2, -6 }, 4 });
-	voxels.push({ { -12, 0, -8 }, 6 });
-	voxels.push({ { -12, 1, -8 }, 6 });
-	voxels.push({ { -12, 4, -8 }, 6 });
-	voxels.push({ { -12, 3, -8 }, 6 });
-	voxels.push({ { -12, 2, -8 }, 6 });
-	voxels.push({ { -13, 4, -9 }, 7 });
-	voxels.push({ { -13, 4, -8 }, 7 });
-	voxels.push({ { -14, 4, -9 }, 7 });
-	voxels.push({ { -14, 4, -8 }, 7 });
-	voxels.push({ { -19, 4, -9 }, 7 });
-	voxels.push({ { -19, 4, -8 }, 7 });
-	voxels.push({ { -20, 4, -9 }, 6 });
-	voxels.push({ { -20, 4, -8 }, 6 });
-	voxels.push({ { -20, 3, -9 }, 6 });
-	voxels.push({ { -20, 3, -8 }, 6 });
-	voxels.push({ { -21, 2, -9 }, 6 });
-	voxels.push({ { -19, 5, 9 }, 9 });
-	voxels.push({ { -17, 6, 5 }, 9 });
-	voxels.push({ { -17, 5, 0 }, 9 });
-	voxels.push({ { -17, 5, 1 }, 9 });
-	voxels.push({ { -18, 5, 0 }, 9 });
-	voxels.push({ { -18, 5, 1 }, 9 });
-	voxels.push({ { -20, 4, -3 }, 9 });
-	voxels.push({ { -13, 1, 12 }, 3 });
-	voxels.push({ { -12, 1, 12 }, 3 });
-	voxels.push({ { -12, 0, 13 }, 3 });
-	voxels.push({ { -13, 0, 13 }, 3 });
-	voxels.push({ { -13, 1, 13 }, 3 });
-	voxels.push({ { -12, 1, 13 }, 3 });
-	voxels.push({ { -12, 2, 11 }, 3 });
-	voxels.push({ { -13, 2, 11 }, 3 });
-	voxels.push({ { -12, 3, 10 }, 3 });
-	voxels.push({ { -13, 3, 10 }, 3 });
-	voxels.push({ { -12, 3, 11 }, 3 });
-	voxels.push({ { -13, 3, 11 }, 3 });
-	voxels.push({ { -13, 3, 9 }, 4 });
-	voxels.push({ { -12, 3, 9 }, 4 });
-	voxels.push({ { -12, 3, 8 }, 4 });
-	voxels.push({ { -13, 3, 7 }, 4 });
-	voxels.push({ { -11, 3, 6 }, 4 });
-	voxels.push({ { -11, 3, 5 }, 4 });
-	voxels.push({ { -10, 3, 5 }, 4 });
-	voxels.push({ { -9, 3, 6 }, 4 });
-	voxels.push({ { -8, 3, 6 }, 4 });
-	voxels.push({ { -8, 3, 5 }, 4 });
-	voxels.push({ { -7, 3, 6 }, 4 });
-	voxels.push({ { -6, 3, 6 }, 3 });
-	voxels.push({ { -5, 0, 6 }, 3 });
-	voxels.push({ { -5, 1, 6 }, 3 });
-	voxels.push({ { -5, 2, 6 }, 3 });
-	voxels.push({ { -5, 3, 6 }, 3 });
-	voxels.push({ { -4, 3, 6 }, 3 });
-	voxels.push({ { -3, 3, 6 }, 3 });
-	voxels.push({ { -2, 3, 6 }, 3 });
-	voxels.push({ { -1, 3, 6 }, 3 });
-	voxels.push({ { 0, 3, 6 }, 3 });
-	voxels.push({ { 1, 3, 6 }, 7 });
-	voxels.push({ { 1, 3, 7 }, 7 });
-	voxels.push({ { 1, 3, 5 }, 7 });
-	voxels.push({ { 2, 4, 7 }, 7 });
-	voxels.push({ { 2, 4, 5 }, 7 });
-	voxels.push({ { 2, 4, 6 }, 6 });
-	voxels.push({ { 2, 5, 5 }, 6 });
-	voxels.push({ { 2, 5, 6 }, 6 });
-	voxels.push({ { 2, 5, 7 }, 6 });
-	voxels.push({ { 2, 6, 6 }, 6 });
-	voxels.push({ { -24, 4, -1 }, 8 });
-	voxels.push({ { -29, 5, -5 }, 8 });
-	voxels.push({ { -35, 5, 0 }, 8 });
-	voxels.push({ { -40, 6, -5 }, 9 });
-	voxels.push({ { -40, 6, -6 }, 9 });
-	voxels.push({ { -40, 6, -4 }, 9 });
-	voxels.push({ { -41, 7, -4 }, 9 });
-	voxels.push({ { -41, 7, -5 }, 9 });
-	voxels.push({ { -41, 7, -6 }, 9 });
-	voxels.push({ { -41, 8, -5 }, 9 });
-	voxels.push({ { -41, 8, -6 }, 6 });
-	voxels.push({ { -41, 8, -4 }, 6 });
-	voxels.push({ { -6, 3, -8 }, 4 });
-	voxels.push({ { -5, 3, -8 }, 4 });
-	voxels.push({ { -4, 3, -8 }, 4 });
-	voxels.push({ { -6, 3, -9 }, 4 });
-	voxels.push({ { -5, 3, -9 }, 4 });
-	voxels.push({ { -4, 3, -9 }, 4 });
-	voxels.push({ { -6, 3, -10 }, 4 });
-	voxels.push({ { -5, 3, -10 }, 4 });
-	voxels.push({ { -4, 3, -10 }, 4 });
-	voxels.push({ { -3, 3, -7 }, 4 });
-	voxels.push({ { -3, 3, -8 }, 4 });
-	voxels.push({ { -3, 3, -9 }, 4 });
-	voxels.push({ { -3, 3, -10 }, 4 });
-	voxels.push({ { -2, 3, -7 }, 4 });
-	voxels.push({ { -2, 3, -8 }, 4 });
-	voxels.push({ { -2, 3, -9 }, 4 });
-	voxels.push({ { -2, 3, -10 }, 4 });
-	voxels.push({ { -1, 3, -7 }, 4 });
-	voxels.push({ { -1, 3, -8 }, 4 });
-	voxels.push({ { -1, 3, -9 }, 4 });
-	voxels.push({ { -1, 3, -10 }, 4 });
-	voxels.push({ { -6, 3, -11 }, 4 });
-	voxels.push({ { -5, 3, -11 }, 4 });
-	voxels.push({ { -4, 3, -11 }, 4 });
-	voxels.push({ { -3, 3, -11 }, 4 });
-	voxels.push({ { -2, 3, -11 }, 4 });
-	voxels.push({ { -1, 3, -11 }, 4 });
-	voxels.push({ { 0, 3, -7 }, 7 });
-	voxels.push({ { 0, 3, -9 }, 7 });
-	voxels.push({ { 0, 3, -8 }, 7 });
-	voxels.push({ { 0, 3, -10 }, 7 });
-	voxels.push({ { 0, 3, -11 }, 7 });
-	voxels.push({ { -1, 3, -12 }, 7 });
-	voxels.push({ { -5, 3, -12 }, 7 });
-	voxels.push({ { -4, 3, -12 }, 7 });
-	voxels.push({ { -3, 3, -12 }, 7 });
-	voxels.push({ { -2, 3, -12 }, 7 });
-	voxels.push({ { 0, 3, -12 }, 7 });
-	voxels.push({ { -6, 3, -12 }, 7 });
-	voxels.push({ { 1, 4, -7 }, 9 });
-	voxels.push({ { 1, 4, -8 }, 9 });
-	voxels.push({ { 1, 4, -9 }, 9 });
-	voxels.push({ { 1, 4, -10 }, 9 });
-	voxels.push({ { 1, 4, -11 }, 9 });
-	voxels.push({ { 1, 4, -12 }, 9 });
-	voxels.push({ { 2, 4, -12 }, 9 });
-	voxels.push({ { 2, 4, -11 }, 9 });
-	voxels.push({ { 2, 4, -10 }, 9 });
-	voxels.push({ { 2, 4, -9 }, 9 });
-	voxels.push({ { 3, 4, -7 }, 3 });
-	voxels.push({ { 3, 4, -9 }, 3 });
-	voxels.push({ { 3, 4, -11 }, 3 });
-	voxels.push({ { 3, 4, -12 }, 3 });
-	voxels.push({ { 3, 4, -10 }, 3 });
-	voxels.push({ { 3, 4, -8 }, 3 });
-	voxels.push({ { 4, 4, -12 }, 3 });
-	voxels.push({ { 4, 4, -11 }, 3 });
-	voxels.push({ { 4, 4, -10 }, 3 });
-	voxels.push({ { 4, 4, -9 }, 3 });
-	voxels.push({ { 4, 4, -8 }, 3 });
-	voxels.push({ { 4, 4, -7 }, 3 });
-	voxels.push({ { 5, 4, -12 }, 3 });
-	voxels.push({ { 5, 4, -10 }, 3 });
-	voxels.push({ { 5, 4, -9 }, 3 });
-	voxels.push({ { 5, 4, -8 }, 3 });
-	voxels.push({ { 5, 4, -7 }, 3 });
-	voxels.push({ { 5, 4, -11 }, 3 });
-	voxels.push({ { 6, 4, -12 }, 3 });
-	voxels.push({ { 6, 4, -11 }, 3 });
-	voxels.push({ { 6, 4, -10 }, 3 });
-	voxels.push({ { 6, 4, -9 }, 3 });
-	voxels.push({ { 6, 4, -8 }, 3 });
-	voxels.push({ { 6, 4, -7 }, 3 });
-	voxels.push({ { 7, 4, -10 }, 3 });
-	voxels.push({ { 7, 4, -9 }, 3 });
-	voxels.push({ { 7, 4, -8 }, 3 });
-	voxels.push({ { 7, 4, -7 }, 3 });
-	voxels.push({ { 6, 4, -6 }, 3 });
-	voxels.push({ { 7, 4, -6 }, 3 });
-	voxels.push({ { 8, 4, -8 }, 3 });
-	voxels.push({ { 8, 4, -7 }, 3 });
-	voxels.push({ { 8, 4, -6 }, 3 });
-	voxels.push({ { 9, 4, -8 }, 3 });
-	voxels.push({ { 9, 4, -7 }, 3 });
-	voxels.push({ { 6, 4, -5 }, 3 });
-	voxels.push({ { 7, 4, -5 }, 3 });
-	voxels.push({ { 8, 4, -5 }, 3 });
-	voxels.push({ { 9, 4, -6 }, 3 });
-	voxels.push({ { 9, 4, -5 }, 3 });
-	voxels.push({ { 7, 2, -4 }, 2 });
-	voxels.push({ { 7, 3, -4 }, 2 });
-	voxels.push({ { 8, 3, -4 }, 2 });
-	voxels.push({ { 8, 2, -4 }, 2 });
-	voxels.push({ { 7, 4, -4 }, 2 });
-	voxels.push({ { 8, 4, -4 }, 2 });
-	voxels.push({ { 6, 4, -4 }, 2 });
-	voxels.push({ { 9, 4, -4 }, 2 });
-	voxels.push({ { 8, 3, 7 }, 10 });
-	voxels.push({ { 9, 3, 7 }, 10 });
-	voxels.push({ { 8, 3, 6 }, 10 });
-	voxels.push({ { 7, 3, 7 }, 10 });
-	voxels.push({ { 8, 3, 8 }, 10 });
-	voxels.push({ { 8, 3, 5 }, 10 });
-	voxels.push({ { 10, 3, 7 }, 10 });
-	voxels.push({ { 8, 3, 9 }, 10 });
-	voxels.push({ { 6, 3, 7 }, 10 });
-	voxels.push({ { 9, 3, 6 }, 9 });
-	voxels.push({ { 7, 3, 6 }, 9 });
-	voxels.push({ { 9, 3, 8 }, 9 });
-	voxels.push({ { 9, 3, 9 }, 9 });
-	voxels.push({ { 10, 3, 9 }, 9 });
-	voxels.push({ { 10, 3, 8 }, 9 });
-	voxels.push({ { 9, 3, 5 }, 9 });
-	voxels.push({ { 10, 3, 5 }, 9 });
-	voxels.push({ { 10, 3, 6 }, 9 });
-	voxels.push({ { 6, 3, 6 }, 9 });
-	voxels.push({ { 7, 3, 5 }, 9 });
-	voxels.push({ { 6, 3, 5 }, 9 });
-	voxels.push({ { 7, 4, 8 }, 4 });
-	voxels.push({ { 7, 4, 9 }, 4 });
-	voxels.push({ { 7, 5, 8 }, 4 });
-	voxels.push({ { 7, 5, 9 }, 4 });
-	voxels.push({ { 6, 6, 8 }, 4 });
-	voxels.push({ { 6, 6, 9 }, 4 });
-	voxels.push({ { 5, 6, 8 }, 4 });
-	voxels.push({ { 5, 6, 9 }, 4 });
-	voxels.push({ { 4, 6, 8 }, 4 });
-	voxels.push({ { 4, 6, 9 }, 4 });
-	voxels.push({ { -31, 2, -8 }, 8 });
-	voxels.push({ { 9, 6, -12 }, 6 });
-	voxels.push({ { 9, 6, -11 }, 6 });
-	voxels.push({ { 9, 6, -10 }, 6 });
-	voxels.push({ { 9, 6, -9 }, 6 });
-	voxels.push({ { 7, 0, -3 }, 4 });
-	voxels.push({ { 8, 0, -3 }, 4 });
-	voxels.push({ { 7, 1, -3 }, 4 });
-	voxels.push({ { 8, 1, -3 }, 4 });
-	voxels.push({ { -21, 2, -8 }, 6 });
-	voxels.push({ { 2, 4, -8 }, 9 });
-	voxels.push({ { 2, 4, -7 }, 9 });
-	voxels.push({ { 7, 4, -11 }, 3 });
-	voxels.push({ { 7, 4, -12 }, 3 });
-	voxels.push({ { 8, 6, -12 }, 10 });
-	voxels.push({ { 8, 6, -9 }, 10 });
-	voxels.push({ { 8, 6, -11 }, 10 });
-	voxels.push({ { 8, 6, -10 }, 10 });
+	boxes.create(64);
+	addVoxel({ { -132, 0, 71 }, 7 });
+	addVoxel({ { -4, 0, -3 }, 2 });
+	addVoxel({ { -5, 0, -3 }, 2 });
+	addVoxel({ { -6, 0, -3 }, 2 });
+	addVoxel({ { -4, 0, -4 }, 2 });
+	addVoxel({ { -5, 0, -4 }, 2 });
+	addVoxel({ { -6, 0, -4 }, 2 });
+	addVoxel({ { -4, 0, -5 }, 2 });
+	addVoxel({ { -5, 0, -5 }, 2 });
+	addVoxel({ { -6, 0, -5 }, 2 });
+	addVoxel({ { -5, 1, -6 }, 4 });
+	addVoxel({ { -5, 3, -7 }, 4 });
+	addVoxel({ { -5, 2, -6 }, 4 });
+	addVoxel({ { -4, 1, -6 }, 4 });
+	addVoxel({ { -4, 2, -6 }, 4 });
+	addVoxel({ { -6, 1, -6 }, 4 });
+	addVoxel({ { -6, 2, -6 }, 4 });
+	addVoxel({ { -6, 3, -7 }, 4 });
+	addVoxel({ { -4, 3, -7 }, 4 });
+	addVoxel({ { -7, 3, -7 }, 4 });
+	addVoxel({ { -7, 0, -6 }, 4 });
+	addVoxel({ { -7, 1, -6 }, 4 });
+	addVoxel({ { -7, 2, -6 }, 4 });
+	addVoxel({ { -12, 0, -8 }, 6 });
+	addVoxel({ { -12, 1, -8 }, 6 });
+	addVoxel({ { -12, 4, -8 }, 6 });
+	addVoxel({ { -12, 3, -8 }, 6 });
+	addVoxel({ { -12, 2, -8 }, 6 });
+	addVoxel({ { -13, 4, -9 }, 7 });
+	addVoxel({ { -13, 4, -8 }, 7 });
+	addVoxel({ { -14, 4, -9 }, 7 });
+	addVoxel({ { -14, 4, -8 }, 7 });
+	addVoxel({ { -19, 4, -9 }, 7 });
+	addVoxel({ { -19, 4, -8 }, 7 });
+	addVoxel({ { -20, 4, -9 }, 6 });
+	addVoxel({ { -20, 4, -8 }, 6 });
+	addVoxel({ { -20, 3, -9 }, 6 });
+	addVoxel({ { -20, 3, -8 }, 6 });
+	addVoxel({ { -21, 2, -9 }, 6 });
+	addVoxel({ { -19, 5, 9 }, 9 });
+	addVoxel({ { -17, 6, 5 }, 9 });
+	addVoxel({ { -17, 5, 0 }, 9 });
+	addVoxel({ { -17, 5, 1 }, 9 });
+	addVoxel({ { -18, 5, 0 }, 9 });
+	addVoxel({ { -18, 5, 1 }, 9 });
+	addVoxel({ { -20, 4, -3 }, 9 });
+	addVoxel({ { -13, 1, 12 }, 3 });
+	addVoxel({ { -12, 1, 12 }, 3 });
+	addVoxel({ { -12, 0, 13 }, 3 });
+	addVoxel({ { -13, 0, 13 }, 3 });
+	addVoxel({ { -13, 1, 13 }, 3 });
+	addVoxel({ { -12, 1, 13 }, 3 });
+	addVoxel({ { -12, 2, 11 }, 3 });
+	addVoxel({ { -13, 2, 11 }, 3 });
+	addVoxel({ { -12, 3, 10 }, 3 });
+	addVoxel({ { -13, 3, 10 }, 3 });
+	addVoxel({ { -12, 3, 11 }, 3 });
+	addVoxel({ { -13, 3, 11 }, 3 });
+	addVoxel({ { -13, 3, 9 }, 4 });
+	addVoxel({ { -12, 3, 9 }, 4 });
+	addVoxel({ { -12, 3, 8 }, 4 });
+	addVoxel({ { -13, 3, 7 }, 4 });
+	addVoxel({ { -11, 3, 6 }, 4 });
+	addVoxel({ { -11, 3, 5 }, 4 });
+	addVoxel({ { -10, 3, 5 }, 4 });
+	addVoxel({ { -9, 3, 6 }, 4 });
+	addVoxel({ { -8, 3, 6 }, 4 });
+	addVoxel({ { -8, 3, 5 }, 4 });
+	addVoxel({ { -7, 3, 6 }, 4 });
+	addVoxel({ { -6, 3, 6 }, 3 });
+	addVoxel({ { -5, 0, 6 }, 3 });
+	addVoxel({ { -5, 1, 6 }, 3 });
+	addVoxel({ { -5, 2, 6 }, 3 });
+	addVoxel({ { -5, 3, 6 }, 3 });
+	addVoxel({ { -4, 3, 6 }, 3 });
+	addVoxel({ { -3, 3, 6 }, 3 });
+	addVoxel({ { -2, 3, 6 }, 3 });
+	addVoxel({ { -1, 3, 6 }, 3 });
+	addVoxel({ { 0, 3, 6 }, 3 });
+	addVoxel({ { 1, 3, 6 }, 7 });
+	addVoxel({ { 1, 3, 7 }, 7 });
+	addVoxel({ { 1, 3, 5 }, 7 });
+	addVoxel({ { 2, 4, 7 }, 7 });
+	addVoxel({ { 2, 4, 5 }, 7 });
+	addVoxel({ { 2, 4, 6 }, 6 });
+	addVoxel({ { 2, 5, 5 }, 6 });
+	addVoxel({ { 2, 5, 6 }, 6 });
+	addVoxel({ { 2, 5, 7 }, 6 });
+	addVoxel({ { 2, 6, 6 }, 6 });
+	addVoxel({ { -24, 4, -1 }, 8 });
+	addVoxel({ { -29, 5, -5 }, 8 });
+	addVoxel({ { -35, 5, 0 }, 8 });
+	addVoxel({ { -40, 6, -5 }, 9 });
+	addVoxel({ { -40, 6, -6 }, 9 });
+	addVoxel({ { -40, 6, -4 }, 9 });
+	addVoxel({ { -41, 7, -4 }, 9 });
+	addVoxel({ { -41, 7, -5 }, 9 });
+	addVoxel({ { -41, 7, -6 }, 9 });
+	addVoxel({ { -41, 8, -5 }, 9 });
+	addVoxel({ { -41, 8, -6 }, 6 });
+	addVoxel({ { -41, 8, -4 }, 6 });
+	addVoxel({ { -6, 3, -8 }, 4 });
+	addVoxel({ { -5, 3, -8 }, 4 });
+	addVoxel({ { -4, 3, -8 }, 4 });
+	addVoxel({ { -6, 3, -9 }, 4 });
+	addVoxel({ { -5, 3, -9 }, 4 });
+	addVoxel({ { -4, 3, -9 }, 4 });
+	addVoxel({ { -6, 3, -10 }, 4 });
+	addVoxel({ { -5, 3, -10 }, 4 });
+	addVoxel({ { -4, 3, -10 }, 4 });
+	addVoxel({ { -3, 3, -7 }, 4 });
+	addVoxel({ { -3, 3, -8 }, 4 });
+	addVoxel({ { -3, 3, -9 }, 4 });
+	addVoxel({ { -3, 3, -10 }, 4 });
+	addVoxel({ { -2, 3, -7 }, 4 });
+	addVoxel({ { -2, 3, -8 }, 4 });
+	addVoxel({ { -2, 3, -9 }, 4 });
+	addVoxel({ { -2, 3, -10 }, 4 });
+	addVoxel({ { -1, 3, -7 }, 4 });
+	addVoxel({ { -1, 3, -8 }, 4 });
+	addVoxel({ { -1, 3, -9 }, 4 });
+	addVoxel({ { -1, 3, -10 }, 4 });
+	addVoxel({ { -6, 3, -11 }, 4 });
+	addVoxel({ { -5, 3, -11 }, 4 });
+	addVoxel({ { -4, 3, -11 }, 4 });
+	addVoxel({ { -3, 3, -11 }, 4 });
+	addVoxel({ { -2, 3, -11 }, 4 });
+	addVoxel({ { -1, 3, -11 }, 4 });
+	addVoxel({ { 0, 3, -7 }, 7 });
+	addVoxel({ { 0, 3, -9 }, 7 });
+	addVoxel({ { 0, 3, -8 }, 7 });
+	addVoxel({ { 0, 3, -10 }, 7 });
+	addVoxel({ { 0, 3, -11 }, 7 });
+	addVoxel({ { -1, 3, -12 }, 7 });
+	addVoxel({ { -5, 3, -12 }, 7 });
+	addVoxel({ { -4, 3, -12 }, 7 });
+	addVoxel({ { -3, 3, -12 }, 7 });
+	addVoxel({ { -2, 3, -12 }, 7 });
+	addVoxel({ { 0, 3, -12 }, 7 });
+	addVoxel({ { -6, 3, -12 }, 7 });
+	addVoxel({ { 1, 4, -7 }, 9 });
+	addVoxel({ { 1, 4, -8 }, 9 });
+	addVoxel({ { 1, 4, -9 }, 9 });
+	addVoxel({ { 1, 4, -10 }, 9 });
+	addVoxel({ { 1, 4, -11 }, 9 });
+	addVoxel({ { 1, 4, -12 }, 9 });
+	addVoxel({ { 2, 4, -12 }, 9 });
+	addVoxel({ { 2, 4, -11 }, 9 });
+	addVoxel({ { 2, 4, -10 }, 9 });
+	addVoxel({ { 2, 4, -9 }, 9 });
+	addVoxel({ { 3, 4, -7 }, 3 });
+	addVoxel({ { 3, 4, -9 }, 3 });
+	addVoxel({ { 3, 4, -11 }, 3 });
+	addVoxel({ { 3, 4, -12 }, 3 });
+	addVoxel({ { 3, 4, -10 }, 3 });
+	addVoxel({ { 3, 4, -8 }, 3 });
+	addVoxel({ { 4, 4, -12 }, 3 });
+	addVoxel({ { 4, 4, -11 }, 3 });
+	addVoxel({ { 4, 4, -10 }, 3 });
+	addVoxel({ { 4, 4, -9 }, 3 });
+	addVoxel({ { 4, 4, -8 }, 3 });
+	addVoxel({ { 4, 4, -7 }, 3 });
+	addVoxel({ { 5, 4, -12 }, 3 });
+	addVoxel({ { 5, 4, -10 }, 3 });
+	addVoxel({ { 5, 4, -9 }, 3 });
+	addVoxel({ { 5, 4, -8 }, 3 });
+	addVoxel({ { 5, 4, -7 }, 3 });
+	addVoxel({ { 5, 4, -11 }, 3 });
+	addVoxel({ { 6, 4, -12 }, 3 });
+	addVoxel({ { 6, 4, -11 }, 3 });
+	addVoxel({ { 6, 4, -10 }, 3 });
+	addVoxel({ { 6, 4, -9 }, 3 });
+	addVoxel({ { 6, 4, -8 }, 3 });
+	addVoxel({ { 6, 4, -7 }, 3 });
+	addVoxel({ { 7, 4, -10 }, 3 });
+	addVoxel({ { 7, 4, -9 }, 3 });
+	addVoxel({ { 7, 4, -8 }, 3 });
+	addVoxel({ { 7, 4, -7 }, 3 });
+	addVoxel({ { 6, 4, -6 }, 3 });
+	addVoxel({ { 7, 4, -6 }, 3 });
+	addVoxel({ { 8, 4, -8 }, 3 });
+	addVoxel({ { 8, 4, -7 }, 3 });
+	addVoxel({ { 8, 4, -6 }, 3 });
+	addVoxel({ { 9, 4, -8 }, 3 });
+	addVoxel({ { 9, 4, -7 }, 3 });
+	addVoxel({ { 6, 4, -5 }, 3 });
+	addVoxel({ { 7, 4, -5 }, 3 });
+	addVoxel({ { 8, 4, -5 }, 3 });
+	addVoxel({ { 9, 4, -6 }, 3 });
+	addVoxel({ { 9, 4, -5 }, 3 });
+	addVoxel({ { 7, 2, -4 }, 2 });
+	addVoxel({ { 7, 3, -4 }, 2 });
+	addVoxel({ { 8, 3, -4 }, 2 });
+	addVoxel({ { 8, 2, -4 }, 2 });
+	addVoxel({ { 7, 4, -4 }, 2 });
+	addVoxel({ { 8, 4, -4 }, 2 });
+	addVoxel({ { 6, 4, -4 }, 2 });
+	addVoxel({ { 9, 4, -4 }, 2 });
+	addVoxel({ { 8, 3, 7 }, 10 });
+	addVoxel({ { 9, 3, 7 }, 10 });
+	addVoxel({ { 8, 3, 6 }, 10 });
+	addVoxel({ { 7, 3, 7 }, 10 });
+	addVoxel({ { 8, 3, 8 }, 10 });
+	addVoxel({ { 8, 3, 5 }, 10 });
+	addVoxel({ { 10, 3, 7 }, 10 });
+	addVoxel({ { 8, 3, 9 }, 10 });
+	addVoxel({ { 6, 3, 7 }, 10 });
+	addVoxel({ { 9, 3, 6 }, 9 });
+	addVoxel({ { 7, 3, 6 }, 9 });
+	addVoxel({ { 9, 3, 8 }, 9 });
+	addVoxel({ { 9, 3, 9 }, 9 });
+	addVoxel({ { 10, 3, 9 }, 9 });
+	addVoxel({ { 10, 3, 8 }, 9 });
+	addVoxel({ { 9, 3, 5 }, 9 });
+	addVoxel({ { 10, 3, 5 }, 9 });
+	addVoxel({ { 10, 3, 6 }, 9 });
+	addVoxel({ { 6, 3, 6 }, 9 });
+	addVoxel({ { 7, 3, 5 }, 9 });
+	addVoxel({ { 6, 3, 5 }, 9 });
+	addVoxel({ { 7, 4, 8 }, 4 });
+	addVoxel({ { 7, 4, 9 }, 4 });
+	addVoxel({ { 7, 5, 8 }, 4 });
+	addVoxel({ { 7, 5, 9 }, 4 });
+	addVoxel({ { 6, 6, 8 }, 4 });
+	addVoxel({ { 6, 6, 9 }, 4 });
+	addVoxel({ { 5, 6, 8 }, 4 });
+	addVoxel({ { 5, 6, 9 }, 4 });
+	addVoxel({ { 4, 6, 8 }, 4 });
+	addVoxel({ { 4, 6, 9 }, 4 });
+	addVoxel({ { -31, 2, -8 }, 8 });
+	addVoxel({ { 9, 6, -12 }, 6 });
+	addVoxel({ { 9, 6, -11 }, 6 });
+	addVoxel({ { 9, 6, -10 }, 6 });
+	addVoxel({ { 9, 6, -9 }, 6 });
+	addVoxel({ { 7, 0, -3 }, 4 });
+	addVoxel({ { 8, 0, -3 }, 4 });
+	addVoxel({ { 7, 1, -3 }, 4 });
+	addVoxel({ { 8, 1, -3 }, 4 });
+	addVoxel({ { -21, 2, -8 }, 6 });
+	addVoxel({ { 2, 4, -8 }, 9 });
+	addVoxel({ { 2, 4, -7 }, 9 });
+	addVoxel({ { 7, 4, -11 }, 3 });
+	addVoxel({ { 7, 4, -12 }, 3 });
+	addVoxel({ { 8, 6, -12 }, 10 });
+	addVoxel({ { 8, 6, -9 }, 10 });
+	addVoxel({ { 8, 6, -11 }, 10 });
+	addVoxel({ { 8, 6, -10 }, 10 });
 	portals.create(2);
 	portals.push({ { 1.999f, 5.46093f, 6.43585f }, { -1, 0, 0 }, 0.6f });
 	portals.push({ { -39.999f, 7.67798f, -4.46772f }, { 1, 0, 0 }, 0.6f });
+	portalLinks.create(2);
+	updatePortalLinks();
 
+	lightBuffer.resize(lights.length());
 	for (size_t i = 0; i < lights.length(); ++i) {
 		lightBuffer[i] = lights[i];
 		lightBuffer[i].color.x = 5 * (rand() / (float)RAND_MAX - 0.5f);
@@ -597,6 +1499,95 @@ void gameOnKey(GLFWwindow*, int key, int scancode, int action, int mods) {
 			gameMode = BuildMode;
 			printf("now in Build Mode\n");
 		break;
+		case GLFW_KEY_Q:      // cycle through the quality levels
+			quality = (Quality)((quality + 1) % NumQualityLevels);
+			loadRaytraceShaders();
+			invalidateIrradianceCache();
+			printf("now using %s quality\n",
+				quality == HighQuality ? "high" :
+				quality == MediumQuality ? "medium" :
+				"low");
+		break;
+		case GLFW_KEY_I:      // cycle through interleaved ray tracing modes
+			interleave = interleave >= 4 ? 1 : 2 * interleave;
+			printf("tracing 1/%d of the pixels each frame\n", (int)interleave);
+		break;
+		case GLFW_KEY_V:      // toggle the rasterized visibility buffer for primary hits
+			useVisibilityBuffer = !useVisibilityBuffer;
+			loadRaytraceShaders();
+			printf("visibility buffer %s\n", useVisibilityBuffer ? "on" : "off");
+		break;
+		case GLFW_KEY_O:      // toggle foveated ray tracing
+			foveated = !foveated;
+			historyValid = false;
+			if (foveated)
+				printf("foveated tracing on, tracing %d%% of the pixels each frame\n",
+					(int)(100 * foveaSamples.size() / (raytraceWidth * raytraceHeight)));
+			else printf("foveated tracing off\n");
+		break;
+		case GLFW_KEY_L:      // toggle the irradiance cache for bounce lighting
+			useIrradianceCache = !useIrradianceCache;
+			loadRaytraceShaders();
+			invalidateIrradianceCache();
+			printf("irradiance cache %s\n", useIrradianceCache ? "on" : "off");
+		break;
+		case GLFW_KEY_R:      // toggle many-light mode, where each pixel only samples one light
+			useManyLights = !useManyLights;
+			loadRaytraceShaders();
+			printf("many-light mode %s\n", useManyLights ? "on" : "off");
+		break;
+		case GLFW_KEY_M:      // cycle through the resolutions of the secondary lighting in mixed resolution mode
+			secondaryScale = secondaryScale >= 4 ? 1 : 2 * secondaryScale;
+			if (secondaryScale > 1)
+				printf("mixed resolution on, tracing lighting and reflections at 1/%d resolution\n", (int)secondaryScale);
+			else printf("mixed resolution off\n");
+		break;
+		case GLFW_KEY_E:      // toggle tracing extra samples for the pixels on edges
+			useEdgeSupersampling = !useEdgeSupersampling;
+			printf("edge supersampling %s\n", useEdgeSupersampling ? "on" : "off");
+		break;
+		case GLFW_KEY_G:      // toggle binning the primitives into screen tiles for the primary rays
+			useTileBinning = !useTileBinning;
+			loadRaytraceShaders();
+			printf("tile binning %s\n", useTileBinning ? "on" : "off");
+		break;
+		case GLFW_KEY_N:      // toggle denoising the lighting in many-light mode
+			useDenoiser = !useDenoiser;
+			printf("denoiser %s\n", useDenoiser ? "on" : "off");
+		break;
+		case GLFW_KEY_U:      // toggle picking on the GPU for the mouse buttons
+			useGpuPicking = !useGpuPicking;
+			hasPick = false;
+			loadRaytraceShaders();
+			printf("GPU picking %s\n", useGpuPicking ? "on" : "off");
+		break;
+		case GLFW_KEY_C:      // cycle through single view, stereo views and split-screen
+			viewMode = (ViewMode)((viewMode + 1) % NumViewModes);
+			splitScreenCameraPos = cameraPos;
+			splitScreenCameraDir = cameraDir;
+			historyValid = false;
+			printf("now using %s\n",
+				viewMode == StereoViews ? "stereo views" :
+				viewMode == SplitScreenViews ? "split-screen" :
+				"a single view");
+		break;
+		case GLFW_KEY_K:      // toggle rendering the portal views to textures
+			usePortalTextures = !usePortalTextures;
+			loadRaytraceShaders();
+			printf("portal textures %s\n", usePortalTextures ? "on" : "off");
+		break;
+		case GLFW_KEY_H:      // hold (pause) the light and portal animations
+			animationPaused = !animationPaused;
+			if (!animationPaused)
+				pausedTime = glfwGetTime() - animationTime;
+			printf("animations %s\n", animationPaused ? "paused" : "running");
+		break;
+		case GLFW_KEY_T:      // print how long each render pass took last frame
+			for (size_t i = 0; i < getRenderPassTimings().size(); ++i) {
+				RenderPassTiming timing = getRenderPassTimings()[i];
+				printf("%-18s cpu %6.3f ms  gpu %6.3f ms\n", timing.name, timing.cpuTime, timing.gpuTime);
+			}
+		break;
 			
 		case GLFW_KEY_0:      // select appropriate material
 		case GLFW_KEY_1:
@@ -617,6 +1608,15 @@ void gameOnKey(GLFWwindow*, int key, int scancode, int action, int mods) {
 	}
 }
 
+// Point the camera in the direction of its pitch and yaw.
+static void updateCameraDir() {
+	mat4 rot = mat4(1);
+	rot *= rotationMat(vec3(0, 1, 0), cameraPitch);
+	rot *= rotationMat(vec3(1, 0, 0), cameraYaw);
+	cameraDir = normalize(vec3(rot * vec4(0, 0, -1, 0)));
+	cameraRight = normalize(cross(cameraDir, cameraUp));
+}
+
 // This is called whenever the mouse is moved to (newX, newY).
 void gameOnMouseMove(GLFWwindow*, double newX, double newY) {
 	double dX = newX - cursorX;
@@ -634,18 +1634,34 @@ void gameOnMouseMove(GLFWwindow*, double newX, double newY) {
 		cameraYaw = -0.99f * PI / 2;
 	}
 
-	mat4 rot = mat4(1);
-	rot *= rotationMat(vec3(0, 1, 0), cameraPitch);
-	rot *= rotationMat(vec3(1, 0, 0), cameraYaw);
-	cameraDir = normalize(vec3(rot * vec4(0, 0, -1, 0)));
-	cameraRight = normalize(cross(cameraDir, cameraUp));
+	updateCameraDir();
 }
 
 // This is called when any mouse button is pressed/released..
 void gameOnMouseButton(GLFWwindow*, int button, int action, int mods) {
 	if (action == GLFW_PRESS) {
+		// Use what the GPU found under the crosshair if it's up to date, and otherwise trace the ray here.
+		// The GPU's ray also goes through the portals.
 		Ray r1 = { cameraPos, cameraDir };
-		Ray r = trace(r1);
+		Ray r;
+		bool picked = useGpuPicking && hasPick;
+		if (picked) {
+			if (latestPick.pos.w == 0)
+				return;
+			r.pos = vec3(latestPick.pos);
+			r.dir = vec3(latestPick.normal);
+		}
+		else r = trace(r1);
+
+		// The scene is about to change so the previous frame can't be reprojected,
+		// and the lighting might change.
+		historyValid = false;
+		invalidateIrradianceCache();
+
+		// The next click has to wait for a pick of the changed scene.
+		hasPick = false;
+		minPickFrame = frameIndex;
+
 		if (gameMode == PlayMode) {
 			Portal newPortal;
 			newPortal.pos = r.pos;
@@ -658,21 +1674,30 @@ void gameOnMouseButton(GLFWwindow*, int button, int action, int mods) {
 			if (button == GLFW_MOUSE_BUTTON_RIGHT) {
 				portals[1] = newPortal;
 			}
+			updatePortalLinks();
 		}
 		else if (gameMode == BuildMode) {
 			if (button == GLFW_MOUSE_BUTTON_LEFT) {
 				Voxel newV;
 				newV.pos = (ivec3)floor((r.pos + 0.5f * r.dir));
 				newV.material = material;
-				voxels.push(newV);
+				addVoxel(newV);
 			}
-			if (button == GLFW_MOUSE_BUTTON_RIGHT) {
+			if (button == GLFW_MOUSE_BUTTON_RIGHT && picked) {
+				// Remove the voxel just behind the face that the ray hit.
+				uint index = latestPick.primitive & 0x0FFFFFFFu;
+				if ((latestPick.primitive >> 28) == voxelPrimitiveType && index < boxes.length()) {
+					Box box = boxes[index];
+					removeVoxel(clamp((ivec3)floor(r.pos - 0.5f * r.dir), box.pos, box.pos + box.size - 1));
+				}
+			}
+			else if (button == GLFW_MOUSE_BUTTON_RIGHT) {
 				float hitDist = floatMax;
 				float closestDist = hitDist;
-				size_t voxIdx = voxels.length();
-				for (size_t i = 0; i < voxels.length(); ++i) {
-					Voxel voxel = voxels[i];
-					float d = intersect(r1, voxel);
+				size_t voxIdx = boxes.length();
+				for (size_t i = 0; i < boxes.length(); ++i) {
+					Box box = boxes[i];
+					float d = intersect(r1, box);
 					if (d > 0 && d < hitDist) {
 						if (closestDist > d) {
 							closestDist = d;
@@ -681,8 +1706,12 @@ void gameOnMouseButton(GLFWwindow*, int button, int action, int mods) {
 					}
 				}
 
-				if (voxIdx < voxels.length())
-					voxels.remove(voxIdx);
+				// Remove the voxel of the box that the ray hit, just past where it went in.
+				if (voxIdx < boxes.length()) {
+					Box box = boxes[voxIdx];
+					vec3 hitPos = r1.pos + r1.dir * (closestDist + rayEpsilon);
+					removeVoxel(clamp((ivec3)floor(hitPos), box.pos, box.pos + box.size - 1));
+				}
 			}
 		}
 	}
@@ -706,6 +1735,297 @@ void gameOnMouseWheel(GLFWwindow*, double dX, double dY) {
 	}
 }
 
+// Read 'count' whole numbers from a config file value. Negative numbers are rejected rather
+// than wrapped around, and huge ones are saturated so that the settings can clamp them.
+static bool readConfigUints(const char *value, uint *u, int count) {
+	for (int i = 0; i < count; ++i) {
+		long n;
+		int length;
+		if (sscanf(value, " %ld%n", &n, &length) != 1 || n < 0)
+			return false;
+		u[i] = (uint)min(n, (long)INT_MAX);
+		value += length;
+	}
+	return true;
+}
+
+// Read the performance settings from a config file. Each line is a 'name = value' pair, where
+// the bounces and the portal recursion take a value for each quality level, and everything after
+// a '#' is a comment. Settings that are missing from the file keep their current value.
+static bool readConfig(const char *filename, double timeout) {
+	size_t size;
+	char *text = readWholeFile(filename, &size, timeout);
+	if (!text)
+		return false;
+
+	for (char *line = strtok(text, "\r\n"); line; line = strtok(NULL, "\r\n")) {
+		char *comment = strchr(line, '#');
+		if (comment) *comment = '\0';
+		char name[64];
+		int valueStart;
+		if (sscanf(line, " %63[a-z_] = %n", name, &valueStart) != 1) {
+			if (strspn(line, " \t") != strlen(line))
+				printf("%s: ignoring '%s'\n", filename, line);
+			continue;
+		}
+
+		const char *value = line + valueStart;
+		uint u[NumQualityLevels];
+		float f;
+		bool valid = true;
+		if (!strcmp(name, "raytrace_width") || !strcmp(name, "raytrace_height")) {
+			// The ray target has to be made out of whole tiles, see 'binTileSize'.
+			valid = readConfigUints(value, u, 1);
+			uint *dim = !strcmp(name, "raytrace_width") ? &raytraceWidth : &raytraceHeight;
+			if (valid) *dim = clamp(u[0] / binTileSize * binTileSize, binTileSize, maxRaytraceSize);
+		}
+		else if (!strcmp(name, "rays_per_pixel")) {
+			valid = readConfigUints(value, u, 1) && u[0] > 0;
+			if (valid) frameRaysPerPixel = min(u[0], maxRaysPerPixel);
+		}
+		else if (!strcmp(name, "bounces") || !strcmp(name, "portal_recursion")) {
+			valid = readConfigUints(value, u, NumQualityLevels);
+			uint *levels = !strcmp(name, "bounces") ? qualityBounces : qualityPortalRecursion;
+			if (valid) memcpy(levels, u, sizeof(u));
+		}
+		else if (!strcmp(name, "light_cutoff")) {
+			valid = sscanf(value, "%f", &f) == 1 && f > 0;
+			if (valid) lightCutoffRadius = f;
+		}
+		else if (!strcmp(name, "fovea_radius")) {
+			valid = sscanf(value, "%f", &f) == 1 && f > 0;
+			if (valid) foveaRadius = f;
+		}
+		else if (!strcmp(name, "vsync") || !strcmp(name, "painting")) {
+			valid = readConfigUints(value, u, 1);
+			if (valid) *(!strcmp(name, "vsync") ? &vsync : &painting) = u[0] != 0;
+		}
+		else if (!strcmp(name, "paint_quality")) {
+			valid = sscanf(value, "%f", &f) == 1 && f > 0 && f <= 1;
+			if (valid) paintQuality = f;
+		}
+		else if (!strcmp(name, "paint_layers")) {
+			valid = readConfigUints(value, u, 1) && u[0] > 0;
+			if (valid) paintLayers = u[0];
+		}
+		else if (!strcmp(name, "auto_tune")) {
+			valid = readConfigUints(value, u, 1);
+			if (valid) autoTune = u[0] != 0;
+		}
+		else if (!strcmp(name, "target_frame_time")) {
+			valid = sscanf(value, "%f", &f) == 1 && f > 0;
+			if (valid) targetFrameTime = f;
+		}
+		else printf("%s: unknown setting '%s'\n", filename, name);
+		if (!valid)
+			printf("%s: invalid value for '%s'\n", filename, name);
+	}
+	free(text);
+	return true;
+}
+
+// Read the config file, and the auto-tuned settings on top of it if they were tuned for the same
+// target frame time. Returns false if the settings still have to be tuned.
+static bool readSettings() {
+	if (!readConfig(configFile, 1))
+		printf("couldn't read '%s', using the current settings\n", configFile);
+	if (!autoTune)
+		return true;
+	float target = targetFrameTime;
+	if (!readConfig(tuneCacheFile, 0))
+		return false;
+	if (targetFrameTime != target) {
+		readConfig(configFile, 1);
+		return false;
+	}
+	return true;
+}
+
+// The paint shader is rebuilt whenever the painting is turned on or off, or its number of layers changes.
+static void loadPaintShader() {
+	char layers[32];
+	sprintf(layers, "PAINT_LAYERS %d", (int)paintLayers);
+	const char *defines[2] = { layers, "PAINTING" };
+	paintShader = loadShader("shaders/paintvert.glsl", "shaders/paintfrag.glsl", defines, painting ? 2 : 1);
+}
+
+// Create everything that depends on the size of the ray target.
+static void createRaytraceTargets() {
+	// Create the history textures for the reprojection pass. Along with the color we
+	// also store the distance to the primary hit which is used for reprojection.
+	for (int i = 0; i < 2; ++i) {
+		reprojectOutputTextures[i] = createTexture(NULL, raytraceWidth, raytraceHeight, GL_RGB16F);
+		reprojectDistanceTextures[i] = createTexture(NULL, raytraceWidth, raytraceHeight, GL_R32F);
+		portalViewTextures[i] = createTexture(NULL, 2 * raytraceWidth / portalViewScale, raytraceHeight / portalViewScale, GL_RGB16F);
+		denoiseHistoryTextures[i] = createTexture(NULL, raytraceWidth, raytraceHeight, GL_RGBA16F);
+		denoiseMomentsTextures[i] = createTexture(NULL, raytraceWidth, raytraceHeight, GL_RG16F);
+	}
+	glCheckErrors();
+
+	edgeSampleBudget = raytraceWidth * raytraceHeight / 8;
+	numBinTiles = (raytraceWidth / binTileSize) * (raytraceHeight / binTileSize);
+	tilePrimitivesBuffer = createGpuBuffer(NULL, numBinTiles * (1 + binTileCapacity) * sizeof(uint));
+
+	// The reservoirs start out empty, with a count of 0. Each one is 5 words, see 'Reservoir' in the ray tracing shader.
+	std::vector<uint> emptyReservoirs(5 * raytraceWidth * raytraceHeight, 0);
+	for (int i = 0; i < 2; ++i)
+		reservoirBuffers[i] = createGpuBuffer(emptyReservoirs.data(), emptyReservoirs.size() * sizeof(uint));
+	buildFoveaSamples();
+	historyValid = false;
+	denoiseHistoryValid = false;
+}
+
+static void destroyRaytraceTargets() {
+	for (int i = 0; i < 2; ++i) {
+		destroyTexture(reprojectOutputTextures[i]);
+		destroyTexture(reprojectDistanceTextures[i]);
+		destroyTexture(portalViewTextures[i]);
+		destroyTexture(denoiseHistoryTextures[i]);
+		destroyTexture(denoiseMomentsTextures[i]);
+		destroyGpuBuffer(reservoirBuffers[i]);
+	}
+	destroyGpuBuffer(tilePrimitivesBuffer);
+}
+
+static Settings getSettings() {
+	Settings settings;
+	settings.raytraceWidth = raytraceWidth;
+	settings.raytraceHeight = raytraceHeight;
+	memcpy(settings.bounces, qualityBounces, sizeof(settings.bounces));
+	memcpy(settings.portalRecursion, qualityPortalRecursion, sizeof(settings.portalRecursion));
+	settings.lightCutoffRadius = lightCutoffRadius;
+	settings.foveaRadius = foveaRadius;
+	settings.painting = painting;
+	settings.paintLayers = paintLayers;
+	return settings;
+}
+
+// Recreate only what depends on the settings that changed since 'old'.
+static void applySettings(const Settings &old) {
+	if (raytraceWidth != old.raytraceWidth || raytraceHeight != old.raytraceHeight) {
+		// The render graph holds on to framebuffers of the old textures.
+		destroyRaytraceTargets();
+		destroyRenderGraph();
+		createRaytraceTargets();
+	}
+	if (memcmp(old.bounces, qualityBounces, sizeof(old.bounces)) ||
+		memcmp(old.portalRecursion, qualityPortalRecursion, sizeof(old.portalRecursion))) {
+		loadRaytraceShaders();
+		invalidateIrradianceCache();
+	}
+	if (lightCutoffRadius != old.lightCutoffRadius)
+		invalidateIrradianceCache();
+	if (foveaRadius != old.foveaRadius)
+		buildFoveaSamples();
+	if (painting != old.painting || paintLayers != old.paintLayers)
+		loadPaintShader();
+	glfwSwapInterval(vsync ? 1 : 0);
+}
+
+static void startTuning() {
+	printf("tuning the settings for %g ms frames, this only happens once\n", targetFrameTime);
+	tuning = true;
+	tuneCandidate = 0;
+	tuneFrame = 0;
+	tuneFrameTime = 0;
+	tuneSavedCameraPos = cameraPos;
+	tuneSavedCameraPitch = cameraPitch;
+	tuneSavedCameraYaw = cameraYaw;
+}
+
+// Keep the picked settings, write them to the cache file and put the camera back.
+static void finishTuning() {
+	const TuneCandidate &picked = tuneCandidates[tuneCandidate];
+	FILE *f = fopen(tuneCacheFile, "w");
+	if (f) {
+		fprintf(f, "# Picked by the auto-tuner, delete this file to tune again.\n");
+		fprintf(f, "target_frame_time = %g\n", targetFrameTime);
+		fprintf(f, "raytrace_width = %d\n", (int)raytraceWidth);
+		fprintf(f, "raytrace_height = %d\n", (int)raytraceHeight);
+		fprintf(f, "bounces = %d %d %d\n", (int)qualityBounces[0], (int)qualityBounces[1], (int)qualityBounces[2]);
+		if (painting)
+			fprintf(f, "paint_quality = %g\n", paintQuality);
+		fclose(f);
+	}
+	else printf("couldn't write '%s'\n", tuneCacheFile);
+	printf("picked %dx%d pixels and %d bounces", (int)picked.raytraceSize, (int)picked.raytraceSize, (int)picked.bounces);
+	if (painting)
+		printf(" and paint quality %g", picked.paintQuality);
+	printf("\n");
+
+	tuning = false;
+	cameraPos = tuneSavedCameraPos;
+	cameraPitch = tuneSavedCameraPitch;
+	cameraYaw = tuneSavedCameraYaw;
+	updateCameraDir();
+	velocityY = 0;
+	historyValid = false;
+}
+
+// Measure the frame time of the current candidate from the pass timings of the last frame,
+// move on to the next candidate when it's done, and move the camera along the path.
+static void updateTuning() {
+	if (tuneFrame > tuneWarmupFrames) {
+		double cpuTime = 0, gpuTime = 0;
+		for (size_t i = 0; i < getRenderPassTimings().size(); ++i) {
+			cpuTime += getRenderPassTimings()[i].cpuTime;
+			gpuTime += getRenderPassTimings()[i].gpuTime;
+		}
+		tuneFrameTime += max(cpuTime, gpuTime);
+	}
+
+	uint numCandidates = sizeof(tuneCandidates) / sizeof(tuneCandidates[0]);
+	if (tuneFrame == tuneWarmupFrames + tuneMeasureFrames) {
+		double frameTime = tuneFrameTime / tuneMeasureFrames;
+		printf("%dx%d pixels, %d bounces", (int)raytraceWidth, (int)raytraceHeight, (int)qualityBounces[0]);
+		if (painting)
+			printf(", paint quality %g", paintQuality);
+		printf(": %.2f ms\n", frameTime);
+		if (frameTime <= targetFrameTime || tuneCandidate + 1 == numCandidates) {
+			finishTuning();
+			return;
+		}
+		++tuneCandidate;
+		tuneFrame = 0;
+		tuneFrameTime = 0;
+	}
+
+	if (tuneFrame == 0) {
+		const TuneCandidate &candidate = tuneCandidates[tuneCandidate];
+		Settings old = getSettings();
+		raytraceWidth = raytraceHeight = candidate.raytraceSize;
+		qualityBounces[HighQuality] = candidate.bounces;
+		qualityBounces[MediumQuality] = min(candidate.bounces, 1u);
+		qualityBounces[LowQuality] = 0;
+		if (painting)
+			paintQuality = candidate.paintQuality;
+		applySettings(old);
+	}
+
+	// Every candidate sees the same views, whatever the player is doing.
+	cameraPos = tunePathCenter;
+	cameraPitch = 2 * PI * tuneFrame / (tuneWarmupFrames + tuneMeasureFrames);
+	cameraYaw = -0.3f;
+	updateCameraDir();
+	velocityY = 0;
+	++tuneFrame;
+}
+
+// Apply the changes to the config file right away. This puts back the config's settings in the middle
+// of tuning too, so the current candidate starts over to be measured with its own settings again.
+static bool onConfigChanged(const char *filename, void*) {
+	Settings old = getSettings();
+	if (!readSettings() && !tuning)
+		startTuning();
+	else if (tuning) {
+		tuneFrame = 0;
+		tuneFrameTime = 0;
+	}
+	applySettings(old);
+	printf("reloaded '%s', tracing %dx%d pixels\n", filename, (int)raytraceWidth, (int)raytraceHeight);
+	return true;
+}
+
 // This should be called to initialize the game.
 void gameInit(GLFWwindow *w) {
 	
@@ -713,14 +2033,10 @@ void gameInit(GLFWwindow *w) {
 	window = w;
 	glfwGetCursorPos(window, &cursorX, &cursorY);
 
-	// Create a 256x256 framebuffer for the raytracer output.
-	glGenFramebuffers(1, &raytraceOutputFramebuffer);
-	glBindFramebuffer(GL_FRAMEBUFFER, raytraceOutputFramebuffer);
-	raytraceOutputTexture = createTexture(NULL, 256, 256, GL_RGB16F);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, raytraceOutputTexture, 0);
-	assert(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
-	glCheckErrors();
+	// The settings have to be known before anything is created.
+	bool tuned = readSettings();
+	glfwSwapInterval(vsync ? 1 : 0);
+	trackFileChanges(configFile, NULL, onConfigChanged);
 
 	// Load all the textures into a texture atlas/array.
 	const char* textureFiles[] = {
@@ -739,9 +2055,20 @@ void gameInit(GLFWwindow *w) {
 	textureAtlas = loadTextureArray(textureFiles, numTextures, GL_RGB8);
 	glCheckErrors();
 
-	// Load both shaders.
-	raytraceShader = loadShader("shaders/rayvert.glsl", "shaders/rayfrag.glsl");
-	paintShader = loadShader("shaders/paintvert.glsl", "shaders/paintfrag.glsl");
+	// Load all the shaders. The ray tracing shader is loaded after the scene since it depends on it.
+	reprojectShader = loadShader("shaders/rayvert.glsl", "shaders/reprojfrag.glsl");
+	loadPaintShader();
+	const char *voxelDefines[] = { "VOXELS_ONLY" };
+	const char *temporalDefines[] = { "TEMPORAL_ACCUMULATION" };
+	upsampleShader = loadShader("shaders/rayvert.glsl", "shaders/upsamplefrag.glsl");
+	coneShader = loadShader("shaders/rayvert.glsl", "shaders/conefrag.glsl");
+	mixedResolutionShader = loadShader("shaders/rayvert.glsl", "shaders/mixedfrag.glsl");
+	edgeShader = loadShader("shaders/rayvert.glsl", "shaders/edgefrag.glsl");
+	binShader = loadComputeShader("shaders/bincomp.glsl");
+	denoiseTemporalShader = loadShader("shaders/rayvert.glsl", "shaders/denoisefrag.glsl", temporalDefines, 1);
+	denoiseFilterShader = loadShader("shaders/rayvert.glsl", "shaders/denoisefrag.glsl");
+	visibilityShader = loadShader("shaders/visvert.glsl", "shaders/visfrag.glsl");
+	visibilityVoxelShader = loadShader("shaders/visvert.glsl", "shaders/visfrag.glsl", voxelDefines, 1);
 	
 	// Load some semi-fake vertex data to render a fullscreen quad.
 	vec2 vertData[] = {
@@ -759,23 +2086,89 @@ void gameInit(GLFWwindow *w) {
 	// We don't need to unbind the VAO or VBO since we only have one..
 	
 	loadScene();
+	loadRaytraceShaders();
+	lightClustersBuffer = createGpuBuffer(NULL, sizeof(uvec2));
+	clusterLightsBuffer = createGpuBuffer(NULL, sizeof(uint));
+	foveaSamplesBuffer = createGpuBuffer(NULL, sizeof(uint));
+	foveaTilesBuffer = createGpuBuffer(NULL, sizeof(uvec2));
+	portalRecursionLimitsBuffer = createGpuBuffer(NULL, sizeof(uint));
+	irradianceCacheBuffer = createGpuBuffer(NULL, sizeof(vec4));
+	irradianceUpdatesBuffer = createGpuBuffer(NULL, irradianceUpdateBudget * sizeof(IrradianceEntry));
+	edgePixelsBuffer = createGpuBuffer(NULL, sizeof(uint));
+	viewsBuffer = createGpuBuffer(NULL, sizeof(GpuViews));
+	for (uint i = 0; i < numPickBuffers; ++i)
+		pickBuffers[i] = createGpuBuffer(NULL, sizeof(Pick));
+	createRaytraceTargets();
+	if (!tuned)
+		startTuning();
 }
 
 // Destroy all resources used by the game.
 void gameTerminate() {
-	destroyShader(paintShader);
-	destroyShader(raytraceShader);
+	destroyAllShaders();
 	destroyGpuBuffer(fullscreenQuad);
 	destroyTextureArray(textureAtlas);
+	destroyRenderGraph();
+	destroyRaytraceTargets();
+	destroyGpuBuffer(foveaSamplesBuffer);
+	destroyGpuBuffer(foveaTilesBuffer);
+	destroyGpuBuffer(portalRecursionLimitsBuffer);
+	destroyGpuBuffer(irradianceCacheBuffer);
+	destroyGpuBuffer(irradianceUpdatesBuffer);
+	destroyGpuBuffer(edgePixelsBuffer);
+	destroyGpuBuffer(viewsBuffer);
+	for (uint i = 0; i < numPickBuffers; ++i) {
+		destroyGpuBuffer(pickBuffers[i]);
+		if (pickFences[i])
+			glDeleteSync(pickFences[i]);
+	}
 	lights.destroy();
 	materials.destroy();
 	planes.destroy();
 	spheres.destroy();
-	voxels.destroy();
+	boxes.destroy();
 	portals.destroy();
+	portalLinks.destroy();
+	destroyGpuBuffer(lightClustersBuffer);
+	destroyGpuBuffer(clusterLightsBuffer);
 	glCheckErrors();
 }
 
+// Paint the final image onto the back buffer.
+static void addPaintPass(RenderTarget displayed, int width, int height) {
+	RenderTarget backbuffer = getBackbuffer(width, height);
+	addRenderPass("paint", { displayed }, { backbuffer }, [=]() {
+		bindShader(paintShader);
+		setUniform(paintShader, 0, 0);
+		setUniform(paintShader, 1, vec2(width, height));
+		if (painting)
+			setUniform(paintShader, 2, paintQuality);
+		bindTexture(getRenderTexture(displayed), 0);
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	});
+}
+
+static void presentFrame(double deltaTime) {
+	// Swap the back buffer and the front buffer to display the new image.
+	glfwSwapBuffers(window);
+
+	// Hacky frame-rate counter that displayes frame rate in the window title..
+	static int frameAcc = 0;
+	static double timeAcc = 0;
+	++frameAcc;
+	timeAcc += deltaTime;
+	while (timeAcc >= 0.25) {
+		char buffer[256];
+		sprintf(buffer, "Painted Portal Tracer [%.1lf fps] - %s mode", frameAcc / timeAcc,
+			gameMode == PlayMode ? "play" :
+			gameMode == BuildMode ? "build" :
+			"???");
+		glfwSetWindowTitle(window, buffer);
+		timeAcc = 0;
+		frameAcc = 0;
+	}
+}
+
 // Call this every frame.
 void gameUpdate(double deltaTime) {
 	float moveSpeed = (float)deltaTime * 5;
@@ -824,17 +2217,15 @@ void gameUpdate(double deltaTime) {
 		float cameraDistanceToPortal = intersect(cameraRay, portalIn);
 		if (cameraDistanceToPortal < 0.5f) {
 
-			portalIn.normal = -portalIn.normal;
-			mat3 M1 = getPortalMatrix(portalIn);
-			mat3 M2 = getPortalMatrix(portalOut);
-
+			PortalLink link = portalLinks[(size_t)portalInIndex];
 			cameraPos = cameraRay.pos + cameraRay.dir * cameraDistanceToPortal;
-			cameraPos = portalOut.pos + inverse(M2) * M1 * (cameraPos - portalIn.pos);
-			cameraDir = normalize(inverse(M2) * M1 * cameraDir);
+			cameraPos = vec3(link.transform * vec4(cameraPos, 1));
+			cameraDir = normalize(mat3(link.transform) * cameraDir);
 			cameraPos += cameraRay.dir * 0.1f;
 			cameraYaw = atan(cameraDir.y);
 			cameraPitch = PI + atan2(cameraDir.x, cameraDir.z);
 			cameraPos += portalOut.normal * 0.1f;
+			historyValid = false;
 		}
 
 		if (velocityY > 0) {
@@ -892,16 +2283,19 @@ void gameUpdate(double deltaTime) {
 	// Move all the lights around.
 	//HACK: The information about how to move all the lights is currently
 	//      stored in a hacky global buffer. We should do this in a cleaner way..
-	float t = (float)glfwGetTime();
-	for (size_t i = 0; i < lights.length(); ++i) {
-		Light l = lights[i];
-		float freqx = lightBuffer[i].color.x;
-		float freqz = lightBuffer[i].color.y;
-		float amplitudex = max(0.4f, 0.4f * (freqx + freqz) * lightBuffer[i].color.z);
-		float amplitudez = max(0.4f, 0.8f * (freqz - freqz) * lightBuffer[i].color.z);
-		l.pos.x = lightBuffer[i].pos.x + amplitudex * cos(freqx * t);
-		l.pos.z = lightBuffer[i].pos.z + amplitudez * sin(freqz * t);
-		lights[i] = l;
+	if (!animationPaused) {
+		animationTime = glfwGetTime() - pausedTime;
+		float t = (float)animationTime;
+		for (size_t i = 0; i < lights.length(); ++i) {
+			Light l = lights[i];
+			float freqx = lightBuffer[i].color.x;
+			float freqz = lightBuffer[i].color.y;
+			float amplitudex = max(0.4f, 0.4f * (freqx + freqz) * lightBuffer[i].color.z);
+			float amplitudez = max(0.4f, 0.8f * (freqz - freqz) * lightBuffer[i].color.z);
+			l.pos.x = lightBuffer[i].pos.x + amplitudex * cos(freqx * t);
+			l.pos.z = lightBuffer[i].pos.z + amplitudez * sin(freqz * t);
+			lights[i] = l;
+		}
 	}
 	
 	//
@@ -911,54 +2305,549 @@ void gameUpdate(double deltaTime) {
 	// First off, we don't have to call glClear since we will
 	// overwrite the whole texture anyway.
 	
-	// First do the ray tracing to a small render buffer.
-	glBindFramebuffer(GL_FRAMEBUFFER, raytraceOutputFramebuffer);
-	glViewport(0, 0, 256, 256);
-	bindShader(raytraceShader);
-	lights.bind(GL_SHADER_STORAGE_BUFFER, 0);
-	materials.bind(GL_SHADER_STORAGE_BUFFER, 1);
-	planes.bind(GL_SHADER_STORAGE_BUFFER, 2);
-	spheres.bind(GL_SHADER_STORAGE_BUFFER, 3);
-	voxels.bind(GL_SHADER_STORAGE_BUFFER, 4);
-	portals.bind(GL_SHADER_STORAGE_BUFFER, 5);
-	bindTextureArray(textureAtlas, 0);
-
 	int width, height;
 	glfwGetFramebufferSize(window, &width, &height);
+	if (width != prevWidth || height != prevHeight) {
+		// The aspect ratio changed so all of the rays changed too.
+		historyValid = false;
+	}
+
+	if (tuning)
+		updateTuning();
+
+	// Merge the voxels that were edited since the last frame into boxes.
+	updateVoxelBoxes();
+
+	// Check if anything changed since the last frame. If not, then either accumulate
+	// another sample of each pixel, or just show the last frame again.
+	uint64_t frameHash = hashFrameState(width, height);
+	bool sceneChanged =
+		lights.isDirty() || materials.isDirty() || planes.isDirty() || spheres.isDirty() ||
+		boxes.isDirty() || portals.isDirty() || portalLinks.isDirty();
+	if (frameHash == prevFrameHash && !sceneChanged && historyValid)
+		++staticFrames;
+	else staticFrames = 0;
+	prevFrameHash = frameHash;
+	bool accumulating = staticFrames > 0 && staticFrames <= maxAccumulatedFrames;
+	bool idle = staticFrames > maxAccumulatedFrames;
+
+	if (idle) {
+		// Nothing changed since the image converged, so there is nothing to trace, only paint the last frame again.
+		addPaintPass(importRenderTarget("history color", reprojectOutputTextures[1 - frameIndex % 2], raytraceWidth, raytraceHeight), width, height);
+		executeRenderGraph();
+		readPicks();
+		presentFrame(deltaTime);
+		return;
+	}
+
+	buildLightClusters();
+	if (useIrradianceCache)
+		updateIrradianceCache();
+
 	mat4 view = lookAtMatRH(cameraPos, cameraDir, cameraUp);
-	setUniform(raytraceShader, 0, vec2(width, height));
-	setUniform(raytraceShader, 1, cameraFoveaDist);
-	setUniform(raytraceShader, 2, cameraPos);
-	setUniform(raytraceShader, 3, mat3(inverse(view)));
-	setUniform(raytraceShader, 8, (float)glfwGetTime());
-	setUniform(raytraceShader, 9, 0);
-	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	mat3 invView = mat3(inverse(view));
+	// Foveated tracing doesn't interleave, the upsampling pass fills in the untraced pixels instead.
+	// When accumulating samples every pixel is traced, since the frames are spent on quality anyway.
+	// Mixed resolution mode already traces fewer rays in a different way, so it does neither.
+	// Multiple views are always traced at full resolution, without any of the passes that only
+	// work for the main camera.
+	bool multiView = viewMode != SingleView;
+	bool framePicked = useGpuPicking && !multiView;
+	bool mixedResolution = secondaryScale > 1 && !multiView;
+	bool frameFoveated = foveated && !accumulating && !mixedResolution && !multiView;
+	uint frameInterleave = historyValid && !foveated && !accumulating && !mixedResolution && !multiView ? interleave : 1;
+
+	// Edges are only supersampled when every pixel is traced, and when the accumulated samples aren't already antialiasing them.
+	bool frameSupersampled = useEdgeSupersampling && !frameFoveated && frameInterleave == 1 && !accumulating && !mixedResolution && !multiView;
+
+	// The light is only noisy in many-light mode, and the denoiser needs every pixel traced where it is.
+	bool frameDenoised = useDenoiser && useManyLights && !frameFoveated && frameInterleave == 1 && !mixedResolution && !multiView;
+	uint numFoveaSamples = frameFoveated ? (uint)foveaSamples.size() : 0;
+	uint numTracedPixels = frameFoveated ? numFoveaSamples : raytraceWidth * raytraceHeight / frameInterleave;
+	if (frameSupersampled)
+		numTracedPixels += edgeSampleBudget;
+	updateRayBudget(invView, width, height, numTracedPixels);
+
+	// Accumulated samples are spread over each pixel, which antialiases the image.
+	uint accumulatedFrames = accumulating ? staticFrames - 1 : 0;
+	vec2 jitter = vec2(0);
+	if (accumulating)
+		jitter = vec2(halton(staticFrames, 2), halton(staticFrames, 3)) - 0.5f;
+	vec2 ndcJitter = 2.0f * jitter / vec2(raytraceWidth, raytraceHeight);
+
+	// Describe the frame as a render graph. Passes that aren't needed with the current settings,
+	// like the visibility buffer or the upsampling, are culled since nothing reads their outputs.
+	uint current = frameIndex % 2;
+	uint previous = 1 - current;
+	RenderTarget visibility = createRenderTarget("visibility", raytraceWidth, raytraceHeight, GL_R32UI);
+	RenderTarget visibilityDepth = createRenderTarget("visibility depth", raytraceWidth, raytraceHeight, GL_DEPTH_COMPONENT32F);
+	RenderTarget coneDistances = createRenderTarget("cone distances", raytraceWidth / coneTileSize, raytraceHeight / coneTileSize, GL_R32F);
+	RenderTarget raytraceColor = createRenderTarget("ray trace color", raytraceWidth, raytraceHeight, GL_RGB16F);
+	RenderTarget raytraceDistance = createRenderTarget("ray trace distance", raytraceWidth, raytraceHeight, GL_R32F);
+	RenderTarget raytracePrimitive = createRenderTarget("ray trace primitive", raytraceWidth, raytraceHeight, GL_R32UI);
+	RenderTarget raytraceNormal = createRenderTarget("ray trace normal", raytraceWidth, raytraceHeight, GL_RGBA16F);
+	RenderTarget raytraceLight = createRenderTarget("ray trace light", raytraceWidth, raytraceHeight, GL_RGBA16F);
+	RenderTarget raytraceLightWeight = createRenderTarget("ray trace light weight", raytraceWidth, raytraceHeight, GL_RGBA16F);
+	RenderTarget edges = createRenderTarget("edges", raytraceWidth, raytraceHeight, GL_R8);
+	RenderTarget supersampledColor = createRenderTarget("supersampled color", raytraceWidth, raytraceHeight, GL_RGB16F);
+	RenderTarget upsampleColor = createRenderTarget("upsample color", raytraceWidth, raytraceHeight, GL_RGB16F);
+	RenderTarget upsampleDistance = createRenderTarget("upsample distance", raytraceWidth, raytraceHeight, GL_R32F);
+	RenderTarget historyColor = importRenderTarget("history color", reprojectOutputTextures[current], raytraceWidth, raytraceHeight);
+	RenderTarget historyDistance = importRenderTarget("history distance", reprojectDistanceTextures[current], raytraceWidth, raytraceHeight);
+	RenderTarget prevHistoryColor = importRenderTarget("previous history color", reprojectOutputTextures[previous], raytraceWidth, raytraceHeight);
+	RenderTarget prevHistoryDistance = importRenderTarget("previous history distance", reprojectDistanceTextures[previous], raytraceWidth, raytraceHeight);
+	uint viewWidth = raytraceWidth / portalViewScale;
+	uint viewHeight = raytraceHeight / portalViewScale;
+	RenderTarget portalViews = importRenderTarget("portal views", portalViewTextures[current], 2 * viewWidth, viewHeight);
+	RenderTarget prevPortalViews = importRenderTarget("previous portal views", portalViewTextures[previous], 2 * viewWidth, viewHeight);
+
+	// Rasterize the scene into the visibility buffer so that the ray tracer only has to
+	// intersect the one object visible at each pixel for the primary hits.
+	addRenderPass("visibility", {}, { visibility, visibilityDepth }, [=]() {
+		const GLuint noPrimitive = 0;
+		const float farDepth = 1;
+		glClearBufferuiv(GL_COLOR, 0, &noPrimitive);
+		glClearBufferfv(GL_DEPTH, 0, &farDepth);
+		glEnable(GL_DEPTH_TEST);
+		planes.bind(GL_SHADER_STORAGE_BUFFER, 2);
+		spheres.bind(GL_SHADER_STORAGE_BUFFER, 3);
+		boxes.bind(GL_SHADER_STORAGE_BUFFER, 4);
+		Shader shaders[] = { visibilityShader, visibilityVoxelShader };
+		for (Shader shader : shaders) {
+			bindShader(shader);
+			setUniform(shader, 0, vec2(width, height));
+			setUniform(shader, 1, cameraFoveaDist);
+			setUniform(shader, 2, cameraPos);
+			setUniform(shader, 3, invView);
+			setUniform(shader, 5, ndcJitter);
+		}
+
+		// The planes and spheres are ray traced per fragment so they write their own depth,
+		// while the voxel boxes are plain cubes where the back faces can be culled.
+		bindShader(visibilityShader);
+		setUniform(visibilityShader, 4, 1u);
+		glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, (GLsizei)planes.length());
+		setUniform(visibilityShader, 4, 2u);
+		glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, (GLsizei)spheres.length());
+		bindShader(visibilityVoxelShader);
+		setUniform(visibilityVoxelShader, 4, 3u);
+		glEnable(GL_CULL_FACE);
+		glDrawArraysInstanced(GL_TRIANGLES, 0, 36, (GLsizei)boxes.length());
+		glDisable(GL_CULL_FACE);
+		glDisable(GL_DEPTH_TEST);
+	});
+
+	// Refresh some of the cached irradiance before the ray tracer reads it.
+	if (useIrradianceCache) {
+		addRenderPass("irradiance", {}, {}, [=]() {
+			uint numUpdates = (uint)irradianceUpdates.size();
+			bindShader(irradianceUpdateShader);
+			lights.bind(GL_SHADER_STORAGE_BUFFER, 0);
+			planes.bind(GL_SHADER_STORAGE_BUFFER, 2);
+			spheres.bind(GL_SHADER_STORAGE_BUFFER, 3);
+			boxes.bind(GL_SHADER_STORAGE_BUFFER, 4);
+			portals.bind(GL_SHADER_STORAGE_BUFFER, 5);
+			bindGpuBuffer(lightClustersBuffer, GL_SHADER_STORAGE_BUFFER, 7);
+			bindGpuBuffer(clusterLightsBuffer, GL_SHADER_STORAGE_BUFFER, 8);
+			bindGpuBuffer(irradianceCacheBuffer, GL_SHADER_STORAGE_BUFFER, 12);
+			bindGpuBuffer(irradianceUpdatesBuffer, GL_SHADER_STORAGE_BUFFER, 13);
+			setUniform(irradianceUpdateShader, 13, clusterGridMin);
+			setUniform(irradianceUpdateShader, 14, clusterCellSize);
+			setUniform(irradianceUpdateShader, 15, clusterGridDims);
+			setUniform(irradianceUpdateShader, 35, lightCutoffRadius);
+			setUniform(irradianceUpdateShader, 21, numUpdates);
+			glDispatchCompute((numUpdates + 63) / 64, 1, 1);
+			glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+		});
+	}
+
+	// Find how far the primary rays can skip ahead for each tile of the ray target.
+	addRenderPass("cones", {}, { coneDistances }, [=]() {
+		bindShader(coneShader);
+		planes.bind(GL_SHADER_STORAGE_BUFFER, 2);
+		spheres.bind(GL_SHADER_STORAGE_BUFFER, 3);
+		boxes.bind(GL_SHADER_STORAGE_BUFFER, 4);
+		portals.bind(GL_SHADER_STORAGE_BUFFER, 5);
+		setUniform(coneShader, 0, vec2(width, height));
+		setUniform(coneShader, 1, cameraFoveaDist);
+		setUniform(coneShader, 2, cameraPos);
+		setUniform(coneShader, 3, invView);
+		setUniform(coneShader, 12, vec2(raytraceWidth, raytraceHeight));
+		setUniform(coneShader, 13, coneTileSize);
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	});
+
+	// Bin the spheres and boxes into the tiles of the ray target that the primary rays could hit them in.
+	if (useTileBinning && !multiView) {
+		addRenderPass("tile binning", {}, {}, [=]() {
+			// The buffer starts with the number of primitives in each tile, which all start out at 0.
+			std::vector<uint> emptyTiles(numBinTiles, 0);
+			updateGpuBuffer(tilePrimitivesBuffer, 0, emptyTiles.data(), emptyTiles.size() * sizeof(uint));
+			bindShader(binShader);
+			spheres.bind(GL_SHADER_STORAGE_BUFFER, 3);
+			boxes.bind(GL_SHADER_STORAGE_BUFFER, 4);
+			bindGpuBuffer(tilePrimitivesBuffer, GL_SHADER_STORAGE_BUFFER, 17);
+			setUniform(binShader, 0, vec2(width, height));
+			setUniform(binShader, 1, cameraFoveaDist);
+			setUniform(binShader, 2, cameraPos);
+			setUniform(binShader, 3, invView);
+			setUniform(binShader, 12, vec2(raytraceWidth, raytraceHeight));
+			setUniform(binShader, 13, binTileSize);
+			setUniform(binShader, 14, binTileCapacity);
+			uint numPrimitives = (uint)(spheres.length() + boxes.length());
+			glDispatchCompute((numPrimitives + 63) / 64, 1, 1);
+			glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+		});
+	}
+
+	// All of the variants of the ray tracing shader take mostly the same inputs. The variant that only
+	// finds the primary surfaces doesn't do any lighting, the secondary lighting variant traces to a
+	// smaller ray target without the visibility buffer, and the portal view variant doesn't need
+	// any of the inputs that have to do with which pixels of the ray target get traced. Neither does the
+	// edge supersampling variant, which traces its own jittered rays without the visibility buffer.
+	// The multi-view variant gets its cameras from the views buffer and doesn't skip ahead with the cones.
+	auto setupRaytraceShader = [=](Shader shader, RaytraceVariant variant, uint scale) {
+		bool tracesTarget = variant != PortalView && variant != EdgeSupersampling && variant != MultiView;
+		bindShader(shader);
+		lights.bind(GL_SHADER_STORAGE_BUFFER, 0);
+		materials.bind(GL_SHADER_STORAGE_BUFFER, 1);
+		planes.bind(GL_SHADER_STORAGE_BUFFER, 2);
+		spheres.bind(GL_SHADER_STORAGE_BUFFER, 3);
+		boxes.bind(GL_SHADER_STORAGE_BUFFER, 4);
+		portals.bind(GL_SHADER_STORAGE_BUFFER, 5);
+		portalLinks.bind(GL_SHADER_STORAGE_BUFFER, 6);
+		bindGpuBuffer(lightClustersBuffer, GL_SHADER_STORAGE_BUFFER, 7);
+		bindGpuBuffer(clusterLightsBuffer, GL_SHADER_STORAGE_BUFFER, 8);
+		bindGpuBuffer(foveaSamplesBuffer, GL_SHADER_STORAGE_BUFFER, 9);
+		bindGpuBuffer(portalRecursionLimitsBuffer, GL_SHADER_STORAGE_BUFFER, 11);
+		if (useIrradianceCache)
+			bindGpuBuffer(irradianceCacheBuffer, GL_SHADER_STORAGE_BUFFER, 12);
+		if (useManyLights) {
+			bindGpuBuffer(reservoirBuffers[current], GL_SHADER_STORAGE_BUFFER, 14);
+			bindGpuBuffer(reservoirBuffers[previous], GL_SHADER_STORAGE_BUFFER, 15);
+		}
+		bindTextureArray(textureAtlas, 0);
+		if (variant != MultiView) {
+			setUniform(shader, 0, vec2(width, height));
+			setUniform(shader, 1, cameraFoveaDist);
+			setUniform(shader, 2, cameraPos);
+			setUniform(shader, 3, invView);
+			setUniform(shader, 12, vec2(raytraceWidth / scale, raytraceHeight / scale));
+		}
+		setUniform(shader, 8, (float)animationTime);
+		setUniform(shader, 9, 0);
+		if (tracesTarget)
+			setUniform(shader, 10, frameInterleave);
+		if (variant != PortalView || useManyLights)
+			setUniform(shader, 11, frameIndex);
+		if (variant != PrimarySurfaces) {
+			setUniform(shader, 13, clusterGridMin);
+			setUniform(shader, 14, clusterCellSize);
+			setUniform(shader, 15, clusterGridDims);
+			setUniform(shader, 35, lightCutoffRadius);
+		}
+		if (variant != PortalView && variant != MultiView) {
+			bindTexture(getRenderTexture(coneDistances), 2);
+			setUniform(shader, 17, 2);
+			setUniform(shader, 18, coneTileSize / scale);
+		}
+		if (tracesTarget) {
+			setUniform(shader, 19, numFoveaSamples);
+			setUniform(shader, 22, jitter);
+		}
+		setUniform(shader, 20, rayBudget);
+		if (useManyLights && variant != PrimarySurfaces && variant != PortalView && variant != MultiView) {
+			setUniform(shader, 23, prevCameraPos);
+			setUniform(shader, 24, prevInvView);
+			setUniform(shader, 25, prevFoveaDist);
+		}
+		if (useVisibilityBuffer && (variant == FullRaytrace || variant == PrimarySurfaces)) {
+			bindTexture(getRenderTexture(visibility), 1);
+			setUniform(shader, 16, 1);
+		}
+		if (framePicked && (variant == FullRaytrace || variant == PrimarySurfaces))
+			bindGpuBuffer(pickBuffers[frameIndex % numPickBuffers], GL_SHADER_STORAGE_BUFFER, 18);
+		if (useTileBinning && (variant == FullRaytrace || variant == PrimarySurfaces)) {
+			bindGpuBuffer(tilePrimitivesBuffer, GL_SHADER_STORAGE_BUFFER, 17);
+			setUniform(shader, 33, binTileSize);
+			setUniform(shader, 34, binTileCapacity);
+		}
+	};
+	std::vector<RenderTarget> raytraceInputs = { coneDistances };
+	if (useVisibilityBuffer)
+		raytraceInputs.push_back(visibility);
+
+	if (mixedResolution) {
+		uint lowWidth = raytraceWidth / secondaryScale;
+		uint lowHeight = raytraceHeight / secondaryScale;
+		RenderTarget surfaceColor = createRenderTarget("surface color", raytraceWidth, raytraceHeight, GL_RGBA16F);
+		RenderTarget surfaceDistance = createRenderTarget("surface distance", raytraceWidth, raytraceHeight, GL_R32F);
+		RenderTarget surfaceNormal = createRenderTarget("surface normal", raytraceWidth, raytraceHeight, GL_RGBA16F);
+		RenderTarget secondaryLight = createRenderTarget("secondary light", lowWidth, lowHeight, GL_RGB16F);
+		RenderTarget secondaryDistance = createRenderTarget("secondary distance", lowWidth, lowHeight, GL_R32F);
+		RenderTarget secondaryReflection = createRenderTarget("secondary reflection", lowWidth, lowHeight, GL_RGB16F);
+		RenderTarget secondaryNormal = createRenderTarget("secondary normal", lowWidth, lowHeight, GL_RGB16F);
+
+		// Find the primary surfaces at full resolution, which is cheap since it's only one ray per pixel.
+		addRenderPass("primary surfaces", raytraceInputs, { surfaceColor, surfaceDistance, surfaceNormal }, [=]() {
+			setupRaytraceShader(primarySurfaceShader, PrimarySurfaces, 1);
+			glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+		});
+
+		// Then trace all of the shadow rays and bounces at the lower resolution.
+		addRenderPass("secondary lighting", { coneDistances }, { secondaryLight, secondaryDistance, secondaryReflection, secondaryNormal }, [=]() {
+			setupRaytraceShader(secondaryLightingShader, SecondaryLighting, secondaryScale);
+			glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+		});
+
+		// And combine them into the same outputs that the full ray tracing pass has.
+		addRenderPass("mixed upsample",
+			{ surfaceColor, surfaceDistance, surfaceNormal, secondaryLight, secondaryReflection, secondaryDistance, secondaryNormal },
+			{ raytraceColor, raytraceDistance }, [=]() {
+			bindShader(mixedResolutionShader);
+			RenderTarget inputs[] = { surfaceColor, surfaceDistance, surfaceNormal, secondaryLight, secondaryReflection, secondaryDistance, secondaryNormal };
+			for (uint i = 0; i < 7; ++i) {
+				bindTexture(getRenderTexture(inputs[i]), i);
+				setUniform(mixedResolutionShader, 12 + i, (int)i);
+			}
+			glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+		});
+	} else if (multiView) {
+		// Split the window and the ray target into views side by side. Stereo views are the player's
+		// eyes, which look in the same direction. The split-screen view is the second camera.
+		GpuViews views = {};
+		views.numViews = maxViews;
+		views.resolution = vec2((float)width / maxViews, (float)height);
+		views.targetSize = vec2((float)(raytraceWidth / maxViews), (float)raytraceHeight);
+		vec3 positions[maxViews] = { cameraPos, cameraPos };
+		mat3 invViews[maxViews] = { invView, invView };
+		if (viewMode == StereoViews) {
+			positions[0] -= 0.5f * eyeSeparation * cameraRight;
+			positions[1] += 0.5f * eyeSeparation * cameraRight;
+		} else {
+			positions[1] = splitScreenCameraPos;
+			invViews[1] = mat3(inverse(lookAtMatRH(splitScreenCameraPos, splitScreenCameraDir, cameraUp)));
+		}
+		for (uint i = 0; i < maxViews; ++i) {
+			views.views[i].cameraPos = vec4(positions[i], cameraFoveaDist);
+			for (int c = 0; c < 3; ++c)
+				views.views[i].invView[c] = vec4(invViews[i].col[c], 0);
+		}
+
+		addRenderPass("multi-view ray trace", {}, { raytraceColor, raytraceDistance }, [=]() {
+			updateGpuBuffer(viewsBuffer, 0, &views, sizeof(views));
+			setupRaytraceShader(multiViewShader, MultiView, 1);
+			bindGpuBuffer(viewsBuffer, GL_UNIFORM_BUFFER, 0);
+			glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+		});
+	} else {
+		// Render the view through each portal, but only where the portal is on screen.
+		if (usePortalTextures) {
+			addRenderPass("portal views", { prevPortalViews }, { portalViews }, [=]() {
+				setupRaytraceShader(portalViewShader, PortalView, portalViewScale);
+				bindTexture(getRenderTexture(prevPortalViews), 3);
+				setUniform(portalViewShader, 26, 3);
+				setUniform(portalViewShader, 27, prevCameraPos);
+				setUniform(portalViewShader, 28, prevInvView);
+				setUniform(portalViewShader, 29, prevFoveaDist);
+				glEnable(GL_SCISSOR_TEST);
+				for (uint i = 0; i < portals.length(); ++i) {
+					vec4 footprint = portalFootprints[i];
+					if (footprint.x >= footprint.z || footprint.y >= footprint.w)
+						continue;
+					int x0 = max(0, (int)floor((0.5f * footprint.x + 0.5f) * viewWidth) - 1);
+					int y0 = max(0, (int)floor((0.5f * footprint.y + 0.5f) * viewHeight) - 1);
+					int x1 = min((int)viewWidth, (int)ceil((0.5f * footprint.z + 0.5f) * viewWidth) + 1);
+					int y1 = min((int)viewHeight, (int)ceil((0.5f * footprint.w + 0.5f) * viewHeight) + 1);
+					glScissor((GLint)(i * viewWidth) + x0, y0, x1 - x0, y1 - y0);
+					glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+				}
+				glDisable(GL_SCISSOR_TEST);
+			});
+			raytraceInputs.push_back(portalViews);
+		}
+
+		// Now do the ray tracing to a small render buffer. When interleaving or foveating, the
+		// traced pixels are packed together into a smaller part of the render buffer.
+		std::vector<RenderTarget> raytraceOutputs = { raytraceColor, raytraceDistance };
+		if (frameSupersampled || frameDenoised)
+			raytraceOutputs.push_back(raytracePrimitive); // Only to keep the outputs at their locations when denoising.
+		if (frameDenoised) {
+			raytraceOutputs.push_back(raytraceNormal);
+			raytraceOutputs.push_back(raytraceLight);
+			raytraceOutputs.push_back(raytraceLightWeight);
+		}
+		addRenderPass("ray trace", raytraceInputs, raytraceOutputs, [=]() {
+			if (frameFoveated)
+				glViewport(0, 0, raytraceWidth, (numFoveaSamples + raytraceWidth - 1) / raytraceWidth);
+			else glViewport(0, 0, raytraceWidth / (frameInterleave > 1 ? 2 : 1), raytraceHeight / (frameInterleave > 2 ? 2 : 1));
+			setupRaytraceShader(raytraceShader, FullRaytrace, 1);
+			if (usePortalTextures) {
+				bindTexture(getRenderTexture(portalViews), 3);
+				setUniform(raytraceShader, 26, 3);
+				setUniform(raytraceShader, 27, cameraPos);
+				setUniform(raytraceShader, 28, invView);
+				setUniform(raytraceShader, 29, cameraFoveaDist);
+			}
+			glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+		});
+
+		// Find the pixels on edges, and trace more samples for them.
+		if (frameSupersampled) {
+			addRenderPass("edges", { raytraceDistance, raytracePrimitive }, { edges }, [=]() {
+				const uint noEdgePixels = 0;
+				recreateGpuBuffer(edgePixelsBuffer, &noEdgePixels, sizeof(noEdgePixels));
+				bindShader(edgeShader);
+				planes.bind(GL_SHADER_STORAGE_BUFFER, 2);
+				spheres.bind(GL_SHADER_STORAGE_BUFFER, 3);
+				boxes.bind(GL_SHADER_STORAGE_BUFFER, 4);
+				bindGpuBuffer(edgePixelsBuffer, GL_SHADER_STORAGE_BUFFER, 16);
+				bindTexture(getRenderTexture(raytraceDistance), 0);
+				bindTexture(getRenderTexture(raytracePrimitive), 1);
+				setUniform(edgeShader, 12, 0);
+				setUniform(edgeShader, 13, 1);
+				glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+			});
+			addRenderPass("supersample", { coneDistances, raytraceColor, edges }, { supersampledColor }, [=]() {
+				glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+				setupRaytraceShader(edgeSupersampleShader, EdgeSupersampling, 1);
+				bindGpuBuffer(edgePixelsBuffer, GL_SHADER_STORAGE_BUFFER, 16);
+				bindTexture(getRenderTexture(raytraceColor), 3);
+				bindTexture(getRenderTexture(edges), 4);
+				setUniform(edgeSupersampleShader, 30, 3);
+				setUniform(edgeSupersampleShader, 31, 4);
+				setUniform(edgeSupersampleShader, 32, edgeSampleBudget);
+				glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+			});
+		}
+	}
+
+	// When foveating, reconstruct the full ray target from the traced pixels.
+	addRenderPass("upsample", { raytraceColor, raytraceDistance }, { upsampleColor, upsampleDistance }, [=]() {
+		bindShader(upsampleShader);
+		bindTexture(getRenderTexture(raytraceColor), 0);
+		bindTexture(getRenderTexture(raytraceDistance), 1);
+		bindGpuBuffer(foveaTilesBuffer, GL_SHADER_STORAGE_BUFFER, 10);
+		setUniform(upsampleShader, 12, 0);
+		setUniform(upsampleShader, 13, 1);
+		setUniform(upsampleShader, 14, foveaTileSize);
+		setUniform(upsampleShader, 15, uvec2(raytraceWidth, raytraceHeight) / foveaTileSize);
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	});
+
+	// Denoise the light reaching the primary hits, first over time and then over space.
+	RenderTarget tracedColor = frameFoveated ? upsampleColor : frameSupersampled ? supersampledColor : raytraceColor;
+	if (frameDenoised) {
+		RenderTarget denoiseHistory = importRenderTarget("denoise history", denoiseHistoryTextures[current], raytraceWidth, raytraceHeight);
+		RenderTarget denoiseMoments = importRenderTarget("denoise moments", denoiseMomentsTextures[current], raytraceWidth, raytraceHeight);
+		RenderTarget prevDenoiseHistory = importRenderTarget("previous denoise history", denoiseHistoryTextures[previous], raytraceWidth, raytraceHeight);
+		RenderTarget prevDenoiseMoments = importRenderTarget("previous denoise moments", denoiseMomentsTextures[previous], raytraceWidth, raytraceHeight);
+		RenderTarget denoiseLight = createRenderTarget("denoise light", raytraceWidth, raytraceHeight, GL_RGBA16F);
+		bool denoiseHistoryUsable = denoiseHistoryValid && historyValid;
+		addRenderPass("denoise temporal",
+			{ raytraceDistance, raytraceNormal, raytraceLight, prevDenoiseHistory, prevDenoiseMoments, prevHistoryDistance },
+			{ denoiseLight, denoiseHistory, denoiseMoments }, [=]() {
+			bindShader(denoiseTemporalShader);
+			RenderTarget inputs[] = { raytraceDistance, raytraceNormal, raytraceLight, prevDenoiseHistory, prevDenoiseMoments, prevHistoryDistance };
+			for (uint i = 0; i < 6; ++i) {
+				bindTexture(getRenderTexture(inputs[i]), i);
+				setUniform(denoiseTemporalShader, 12 + i, (int)i);
+			}
+			setUniform(denoiseTemporalShader, 0, vec2(width, height));
+			setUniform(denoiseTemporalShader, 1, cameraFoveaDist);
+			setUniform(denoiseTemporalShader, 2, cameraPos);
+			setUniform(denoiseTemporalShader, 3, invView);
+			setUniform(denoiseTemporalShader, 18, prevCameraPos);
+			setUniform(denoiseTemporalShader, 19, prevInvView);
+			setUniform(denoiseTemporalShader, 20, prevFoveaDist);
+			setUniform(denoiseTemporalShader, 21, (int)denoiseHistoryUsable);
+			glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+		});
+
+		// Each step doubles the distance between the taps of the filter, and the last one puts the light back into the color.
+		static const char *stepNames[numDenoiseSteps] = { "denoise step 1", "denoise step 2", "denoise step 3", "denoise step 4", "denoise step 5" };
+		RenderTarget denoisedColor = createRenderTarget("denoised color", raytraceWidth, raytraceHeight, GL_RGB16F);
+		for (uint step = 0; step < numDenoiseSteps; ++step) {
+			bool lastStep = step == numDenoiseSteps - 1;
+			RenderTarget input = denoiseLight;
+			RenderTarget output = denoisedColor;
+			if (!lastStep)
+				denoiseLight = output = createRenderTarget("denoise light", raytraceWidth, raytraceHeight, GL_RGBA16F);
+			std::vector<RenderTarget> inputs = { raytraceDistance, raytraceNormal, input };
+			if (lastStep) {
+				inputs.push_back(tracedColor);
+				inputs.push_back(raytraceLight);
+				inputs.push_back(raytraceLightWeight);
+			}
+			addRenderPass(stepNames[step], inputs, { output }, [=]() {
+				bindShader(denoiseFilterShader);
+				const uint locations[] = { 12, 13, 14, 17, 18, 19 };
+				for (uint i = 0; i < inputs.size(); ++i) {
+					bindTexture(getRenderTexture(inputs[i]), i);
+					setUniform(denoiseFilterShader, locations[i], (int)i);
+				}
+				setUniform(denoiseFilterShader, 15, 1 << step);
+				setUniform(denoiseFilterShader, 16, (int)lastStep);
+				glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+			});
+		}
+		tracedColor = denoisedColor;
+	}
+
+	// Then fill in the pixels that weren't traced by reprojecting the previous frame.
+	RenderTarget tracedDistance = frameFoveated ? upsampleDistance : raytraceDistance;
+	addRenderPass("reproject", { tracedColor, tracedDistance, prevHistoryColor, prevHistoryDistance }, { historyColor, historyDistance }, [=]() {
+		bindShader(reprojectShader);
+		bindTexture(getRenderTexture(tracedColor), 0);
+		bindTexture(getRenderTexture(tracedDistance), 1);
+		bindTexture(getRenderTexture(prevHistoryColor), 2);
+		bindTexture(getRenderTexture(prevHistoryDistance), 3);
+		setUniform(reprojectShader, 0, vec2(width, height));
+		setUniform(reprojectShader, 1, cameraFoveaDist);
+		setUniform(reprojectShader, 2, cameraPos);
+		setUniform(reprojectShader, 3, invView);
+		setUniform(reprojectShader, 10, frameInterleave);
+		setUniform(reprojectShader, 11, frameIndex);
+		setUniform(reprojectShader, 12, 0);
+		setUniform(reprojectShader, 13, 1);
+		setUniform(reprojectShader, 14, 2);
+		setUniform(reprojectShader, 15, 3);
+		setUniform(reprojectShader, 16, prevCameraPos);
+		setUniform(reprojectShader, 17, prevInvView);
+		setUniform(reprojectShader, 18, prevFoveaDist);
+		setUniform(reprojectShader, 19, accumulatedFrames);
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	});
 
 	// Now do a second pass with the paint shader
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
-	glViewport(0, 0, width, height);
-	bindShader(paintShader);
-	setUniform(paintShader, 0, 0);
-	setUniform(paintShader, 1, vec2(width, height));
-	bindTexture(raytraceOutputTexture, 0);
-	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	addPaintPass(historyColor, width, height);
 
-	// Swap the back buffer and the front buffer to display the new image.
-	glfwSwapBuffers(window);
+	executeRenderGraph();
 
-	// Hacky frame-rate counter that displayes frame rate in the window title..
-	static int frameAcc = 0;
-	static double timeAcc = 0;
-	++frameAcc;
-	timeAcc += deltaTime;
-	while (timeAcc >= 0.25) {
-		char buffer[256];
-		sprintf(buffer, "Painted Portal Tracer [%.1lf fps] - %s mode", frameAcc / timeAcc,
-			gameMode == PlayMode ? "play" :
-			gameMode == BuildMode ? "build" :
-			"???");
-		glfwSetWindowTitle(window, buffer);
-		timeAcc = 0;
-		frameAcc = 0;
+	// Fence the pick that this frame wrote, replacing the fence of the pick that was in the buffer before if
+	// it's somehow still not done, and read back the ones that are done.
+	if (framePicked) {
+		uint slot = frameIndex % numPickBuffers;
+		if (pickFences[slot])
+			glDeleteSync(pickFences[slot]);
+		pickFences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		pickFrames[slot] = frameIndex;
+	} else {
+		// Nothing traced the crosshair, so the older picks are out of date too.
+		hasPick = false;
+		minPickFrame = frameIndex + 1;
 	}
+	readPicks();
+
+	// Remember this frame so that the next frame can reproject it.
+	prevCameraPos = cameraPos;
+	prevInvView = invView;
+	prevFoveaDist = cameraFoveaDist;
+	prevWidth = width;
+	prevHeight = height;
+	historyValid = true;
+	denoiseHistoryValid = frameDenoised;
+	++frameIndex;
+
+	presentFrame(deltaTime);
 }
\ No newline at end of file
@@ -1,15 +1,24 @@
 #include "graphics.h"
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
+#include <string.h>
 #include <unordered_map>
+#include <map>
+#include <string>
+#include <chrono>
 
 struct ShaderSources {
-	const char *fragFile;
-	const char *vertFile;
+	const char *fragFile; // The compute shader file for compute shaders.
+	const char *vertFile; // NULL for compute shaders.
+	std::string defines; // Already formatted as "#define ..." lines.
+	std::string key;     // Key of the shader in the variant cache.
 };
 
 static std::unordered_map<GLuint, ShaderSources> shaderSources;
 
+// All of the compiled shader variants, keyed by their source files and defines.
+static std::unordered_map<std::string, Shader> shaderVariants;
+
 GpuBuffer createGpuBuffer(void *data, size_t size) {
 	GpuBuffer buffer;
 	glGenBuffers(1, &buffer);
@@ -34,6 +43,14 @@ void updateGpuBuffer(GpuBuffer buffer, size_t offset, const void *data, size_t s
 	glBufferSubData(GL_ARRAY_BUFFER, (GLintptr)offset, (GLsizeiptr)size, data);
 	glCheckErrors();
 }
+void readGpuBuffer(GpuBuffer buffer, size_t offset, void *data, size_t size) {
+	bindGpuBuffer(buffer, GL_ARRAY_BUFFER, 0);
+	GLint bufferSize;
+	glGetBufferParameteriv(GL_ARRAY_BUFFER, GL_BUFFER_SIZE, &bufferSize);
+	assert(offset + size <= (size_t)bufferSize);
+	glGetBufferSubData(GL_ARRAY_BUFFER, (GLintptr)offset, (GLsizeiptr)size, data);
+	glCheckErrors();
+}
 void bindGpuBuffer(GpuBuffer buffer, BufferSlot slot, int binding) {
 	switch (slot) {
 		case GL_SHADER_STORAGE_BUFFER:
@@ -73,6 +90,26 @@ Texture createTexture(const void *pixels, uint width, uint height, TextureStoreF
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 
+	// Integer and depth textures can't be given RGBA bytes, and integer textures
+	// can't be filtered at all, so they are only ever created empty and point sampled.
+	GLenum format = GL_RGBA;
+	GLenum type = GL_UNSIGNED_BYTE;
+	switch (internalFormat) {
+		case GL_R32UI:
+			format = GL_RED_INTEGER;
+			type = GL_UNSIGNED_INT;
+			break;
+		case GL_DEPTH_COMPONENT32F:
+			format = GL_DEPTH_COMPONENT;
+			type = GL_FLOAT;
+			break;
+	}
+	if (format != GL_RGBA) {
+		assert(!pixels);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	}
+
 	glTexImage2D(
 		GL_TEXTURE_2D,		   // Target texture type 
 		0,					   // Mipmap level - ALWAYS 0
@@ -80,8 +117,8 @@ Texture createTexture(const void *pixels, uint width, uint height, TextureStoreF
 		(GLsizei)width,	       // Image width
 		(GLsizei)height,       // Image height
 		0,				       // Border? - always 0 aparently.
-		GL_RGBA,		       // Color components - important not to mess up
-		GL_UNSIGNED_BYTE,      // Component format
+		format,		           // Color components - important not to mess up
+		type,                  // Component format
 		pixels                 // Image data
 	);
 
@@ -117,9 +154,12 @@ TextureArray loadTextureArray(const char* filenames[], uint numFilenames, Textur
 	glGenTextures(1, &tex);
 	assert(tex);
 
-	// First allocate the full storage for the texture array.
+	// First allocate the full storage for the texture array, including all of the mip levels.
+	GLsizei numLevels = 1;
+	while ((width >> numLevels) > 0 || (height >> numLevels) > 0)
+		++numLevels;
 	bindTextureArray(tex, 0);
-	glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, (GLenum)internalFormat, width, height, (GLsizei)numFilenames);
+	glTexStorage3D(GL_TEXTURE_2D_ARRAY, numLevels, (GLenum)internalFormat, width, height, (GLsizei)numFilenames);
 
 	// Then read and copy the pixels over for each texture in the array.
 	glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, 0, width, height, 1, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
@@ -134,8 +174,9 @@ TextureArray loadTextureArray(const char* filenames[], uint numFilenames, Textur
 		stbi_image_free(pixels);
 	}
 
-	// Bilinear filtering and repeat wrapping by default.
-	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	// Trilinear filtering and repeat wrapping by default.
+	glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
 	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
@@ -178,58 +219,74 @@ static size_t sizeofShaderDataType(ShaderDataType type) {
 		default: assert(0); return 0;
 	}
 }
-// Helper function that compiles and links a shader program.
-static bool compileAndLinkShader(GLuint program, const char *vertFile, const char *fragFile) {
-	size_t vertLen, fragLen;
-	char *vertSrc = readWholeFile(vertFile, &vertLen, 0.01);
-	char *fragSrc = readWholeFile(fragFile, &fragLen, 0.01);
-	assert(vertSrc);
-	assert(fragSrc);
-
-	GLuint vert = glCreateShader(GL_VERTEX_SHADER);
-	GLuint frag = glCreateShader(GL_FRAGMENT_SHADER);
-	assert(vert);
-	assert(frag);
-
-	glShaderSource(vert, 1, &vertSrc, NULL);
-	glCompileShader(vert);
-	GLint vertOk;
-	glGetShaderiv(vert, GL_COMPILE_STATUS, &vertOk);
-	if (!vertOk) {
-	#ifndef NDEBUG
-		GLint logLength;
-		glGetShaderiv(vert, GL_INFO_LOG_LENGTH, &logLength);
-		char *log = (char *)malloc((size_t)logLength);
-		glGetShaderInfoLog(vert, logLength, NULL, (GLchar *)log);
-		free(log);
-		printf("GLSL vertex shader: %s\n", log);
-	#endif
-		glDeleteShader(vert);
-		glDeleteShader(frag);
-		return false;
+// Helper function that compiles a single shader stage. The defines are injected right after the #version line.
+static GLuint compileShader(GLenum type, const char *filename, const char *defines) {
+	size_t srcLen;
+	char *src = readWholeFile(filename, &srcLen, 0.01);
+	assert(src);
+
+	// Split the source into the #version line and everything after it, so that we can put the defines
+	// in between. The #line directive makes the compiler report the same line numbers as in the file.
+	char *body = src;
+	if (strncmp(body, "#version", 8) == 0) {
+		while (*body && *body != '\n') ++body;
+		if (*body) ++body;
 	}
+	std::string header(src, (size_t)(body - src));
+	header += defines;
+	header += "#line 2\n";
+	const char *strings[] = { header.c_str(), body };
 
-	glShaderSource(frag, 1, &fragSrc, NULL);
-	glCompileShader(frag);
-	GLint fragOk;
-	glGetShaderiv(frag, GL_COMPILE_STATUS, &fragOk);
-	if (!vertOk) {
+	GLuint shader = glCreateShader(type);
+	assert(shader);
+	glShaderSource(shader, 2, strings, NULL);
+	glCompileShader(shader);
+	free(src);
+
+	GLint ok;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+	if (!ok) {
 	#ifndef NDEBUG
 		GLint logLength;
-		glGetShaderiv(vert, GL_INFO_LOG_LENGTH, &logLength);
+		glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &logLength);
 		char *log = (char *)malloc((size_t)logLength);
-		glGetShaderInfoLog(vert, logLength, NULL, (GLchar *)log);
-		printf("GLSL vertex shader: %s\n", log);
+		glGetShaderInfoLog(shader, logLength, NULL, (GLchar *)log);
+		printf("GLSL %s: %s\n", filename, log);
 		free(log);
 	#endif
-		glDeleteShader(vert);
-		glDeleteShader(frag);
+		glDeleteShader(shader);
+		return 0;
+	}
+	return shader;
+}
+
+// Helper function that compiles and links a shader program.
+// If there is no vertex shader then the fragment shader file is compiled as a compute shader instead.
+static bool compileAndLinkShader(GLuint program, const char *vertFile, const char *fragFile, const char *defines) {
+	GLuint vert = 0;
+	if (vertFile) {
+		vert = compileShader(GL_VERTEX_SHADER, vertFile, defines);
+		if (!vert)
+			return false;
+	}
+	GLuint frag = compileShader(vertFile ? GL_FRAGMENT_SHADER : GL_COMPUTE_SHADER, fragFile, defines);
+	if (!frag) {
+		if (vert)
+			glDeleteShader(vert);
 		return false;
 	}
 
-	glAttachShader(program, vert);
+	if (vert)
+		glAttachShader(program, vert);
 	glAttachShader(program, frag);
 	glLinkProgram(program);
+	if (vert) {
+		glDetachShader(program, vert);
+		glDeleteShader(vert);
+	}
+	glDetachShader(program, frag);
+	glDeleteShader(frag);
+
 	GLint linkOk;
 	glGetProgramiv(program, GL_LINK_STATUS, &linkOk);
 	if (!linkOk) {
@@ -241,28 +298,31 @@ static bool compileAndLinkShader(GLuint program, const char *vertFile, const cha
 		printf("GLSL linker: %s\n", log);
 		free(log);
 	#endif
-		glDeleteShader(vert);
-		glDeleteShader(frag);
 		return false;
 	}
 
-	free(vertSrc);
-	free(fragSrc);
-
-	glDetachShader(program, vert);
-	glDetachShader(program, frag);
-	glDeleteShader(vert);
-	glDeleteShader(frag);
-
 	glCheckErrors();
 	return true;
 }
 
-Shader loadShader(const char *vertFile, const char *fragFile) {
+Shader loadShader(const char *vertFile, const char *fragFile, const char *defines[], uint numDefines) {
+	std::string defineLines;
+	for (uint i = 0; i < numDefines; ++i) {
+		defineLines += "#define ";
+		defineLines += defines[i];
+		defineLines += "\n";
+	}
+
+	// Return the cached variant if we already compiled it.
+	std::string key = std::string(vertFile ? vertFile : "") + "|" + fragFile + "|" + defineLines;
+	auto cached = shaderVariants.find(key);
+	if (cached != shaderVariants.end())
+		return cached->second;
+
 	Shader program = glCreateProgram();
 	assert(program);
 
-	bool linkOk = compileAndLinkShader(program, vertFile, fragFile);
+	bool linkOk = compileAndLinkShader(program, vertFile, fragFile, defineLines.c_str());
 	if (!linkOk) {
 		glDeleteProgram(program);
 		program = 0;
@@ -270,22 +330,32 @@ Shader loadShader(const char *vertFile, const char *fragFile) {
 		ShaderSources sources;
 		sources.vertFile = vertFile;
 		sources.fragFile = fragFile;
+		sources.defines = defineLines;
+		sources.key = key;
 		shaderSources[program] = sources;
+		shaderVariants[key] = program;
 
 		auto recompileShader = [](const char *filename, void *shaderID) {
 			GLuint id = (GLuint)(size_t)shaderID;
-			ShaderSources sources = shaderSources[id];
-			compileAndLinkShader(id, sources.vertFile, sources.fragFile);
+			auto it = shaderSources.find(id);
+			if (it == shaderSources.end())
+				return false; // The shader was destroyed, stop tracking it.
+			ShaderSources &sources = it->second;
+			compileAndLinkShader(id, sources.vertFile, sources.fragFile, sources.defines.c_str());
 			return true;
 		};
 
-		trackFileChanges(vertFile, (void *)(size_t)program, recompileShader);
+		if (vertFile)
+			trackFileChanges(vertFile, (void *)(size_t)program, recompileShader);
 		trackFileChanges(fragFile, (void *)(size_t)program, recompileShader);
 	}
 
 	glCheckErrors();
 	return program;
 }
+Shader loadComputeShader(const char *file, const char *defines[], uint numDefines) {
+	return loadShader(NULL, file, defines, numDefines);
+}
 void setUniform(Shader s, uint location, ShaderDataType type, const void *value, size_t valueSize) {
 	assert(valueSize == sizeofShaderDataType(type));
 	bindShader(s);
@@ -320,6 +390,261 @@ void bindShader(Shader s) {
 	glCheckErrors();
 }
 void destroyShader(Shader s) {
+	auto it = shaderSources.find(s);
+	if (it != shaderSources.end()) {
+		shaderVariants.erase(it->second.key);
+		shaderSources.erase(it);
+	}
 	glDeleteProgram(s);
 	glCheckErrors();
+}
+void destroyAllShaders() {
+	for (auto it = shaderSources.begin(); it != shaderSources.end(); ++it) {
+		glDeleteProgram(it->first);
+	}
+	shaderSources.clear();
+	shaderVariants.clear();
+	glCheckErrors();
+}
+
+struct RenderTargetInfo {
+	const char *name;
+	uint width;
+	uint height;
+	TextureStoreFormat format;
+	Texture texture;   // 0 until the target is allocated, and always 0 for the backbuffer.
+	bool transient;    // Transient targets are allocated from the pool.
+	bool persistent;   // Imported targets and the backbuffer outlive the frame.
+	int producer;      // Index of the pass that writes the target, or -1.
+	int lastUse;       // Index of the last pass that reads or writes the target.
+	bool used;
+};
+
+struct RenderPassInfo {
+	const char *name;
+	std::vector<RenderTarget> inputs;
+	std::vector<RenderTarget> outputs;
+	std::function<void()> execute;
+};
+
+struct PooledTexture {
+	Texture texture;
+	uint width;
+	uint height;
+	TextureStoreFormat format;
+	bool inUse;
+};
+
+// We keep a few timer queries in flight for each pass so that
+// reading the results never has to wait for the GPU to finish.
+static const uint numTimerQueries = 3;
+struct PassTimer {
+	GLuint queries[numTimerQueries];
+	bool pending[numTimerQueries];
+	double gpuTime;
+};
+
+static std::vector<RenderTargetInfo> renderTargets;
+static std::vector<RenderPassInfo> renderPasses;
+static std::vector<PooledTexture> renderTargetPool;
+static std::map<std::vector<Texture>, GLuint> renderFramebuffers;
+static std::unordered_map<std::string, PassTimer> passTimers;
+static std::vector<RenderPassTiming> passTimings;
+static uint renderGraphFrame;
+
+static bool isDepthFormat(TextureStoreFormat format) {
+	return format == GL_DEPTH_COMPONENT16 || format == GL_DEPTH_COMPONENT24 || format == GL_DEPTH_COMPONENT32F;
+}
+
+RenderTarget createRenderTarget(const char *name, uint width, uint height, TextureStoreFormat format) {
+	RenderTargetInfo target = { name, width, height, format, 0, true, false, -1, -1, false };
+	renderTargets.push_back(target);
+	return (RenderTarget)renderTargets.size() - 1;
+}
+RenderTarget importRenderTarget(const char *name, Texture tex, uint width, uint height) {
+	GLint format;
+	bindTexture(tex, 0);
+	glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_INTERNAL_FORMAT, &format);
+	RenderTargetInfo target = { name, width, height, (TextureStoreFormat)format, tex, false, true, -1, -1, false };
+	renderTargets.push_back(target);
+	return (RenderTarget)renderTargets.size() - 1;
+}
+RenderTarget getBackbuffer(uint width, uint height) {
+	RenderTargetInfo target = { "backbuffer", width, height, GL_RGBA8, 0, false, true, -1, -1, false };
+	renderTargets.push_back(target);
+	return (RenderTarget)renderTargets.size() - 1;
+}
+void addRenderPass(const char *name, const std::vector<RenderTarget> &inputs, const std::vector<RenderTarget> &outputs, std::function<void()> execute) {
+	int index = (int)renderPasses.size();
+	for (RenderTarget target : inputs) {
+		// Passes have to be added in order, so whatever a pass reads must have been written already.
+		assert(target < renderTargets.size());
+		assert(renderTargets[target].producer >= 0 || renderTargets[target].persistent);
+	}
+	for (RenderTarget target : outputs) {
+		assert(target < renderTargets.size());
+		assert(renderTargets[target].producer < 0);
+		renderTargets[target].producer = index;
+	}
+	RenderPassInfo pass = { name, inputs, outputs, execute };
+	renderPasses.push_back(pass);
+}
+Texture getRenderTexture(RenderTarget target) {
+	assert(target < renderTargets.size());
+	assert(renderTargets[target].texture || !renderTargets[target].transient);
+	return renderTargets[target].texture;
+}
+
+// Take a free texture with the right size and format out of the pool, or create a new one.
+static Texture acquirePooledTexture(uint width, uint height, TextureStoreFormat format) {
+	for (PooledTexture &pooled : renderTargetPool) {
+		if (!pooled.inUse && pooled.width == width && pooled.height == height && pooled.format == format) {
+			pooled.inUse = true;
+			return pooled.texture;
+		}
+	}
+	PooledTexture pooled = { createTexture(NULL, width, height, format), width, height, format, true };
+	renderTargetPool.push_back(pooled);
+	return pooled.texture;
+}
+static void releasePooledTexture(Texture tex) {
+	for (PooledTexture &pooled : renderTargetPool) {
+		if (pooled.texture == tex)
+			pooled.inUse = false;
+	}
+}
+
+// Get a framebuffer with the given textures attached. Framebuffers are cached by their attachments.
+static GLuint getRenderFramebuffer(const std::vector<RenderTarget> &outputs) {
+	std::vector<Texture> attachments;
+	for (RenderTarget target : outputs)
+		attachments.push_back(renderTargets[target].texture);
+	if (attachments.size() == 1 && attachments[0] == 0)
+		return 0; // The backbuffer.
+
+	auto it = renderFramebuffers.find(attachments);
+	if (it != renderFramebuffers.end())
+		return it->second;
+
+	GLuint framebuffer;
+	glGenFramebuffers(1, &framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	GLenum drawBuffers[8];
+	GLsizei numDrawBuffers = 0;
+	for (RenderTarget target : outputs) {
+		assert(renderTargets[target].texture);
+		if (isDepthFormat(renderTargets[target].format)) {
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, renderTargets[target].texture, 0);
+		}
+		else {
+			assert(numDrawBuffers < 8);
+			drawBuffers[numDrawBuffers] = GL_COLOR_ATTACHMENT0 + (GLenum)numDrawBuffers;
+			glFramebufferTexture2D(GL_FRAMEBUFFER, drawBuffers[numDrawBuffers], GL_TEXTURE_2D, renderTargets[target].texture, 0);
+			++numDrawBuffers;
+		}
+	}
+	glDrawBuffers(numDrawBuffers, drawBuffers);
+	assert(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+	glCheckErrors();
+	renderFramebuffers[attachments] = framebuffer;
+	return framebuffer;
+}
+
+void executeRenderGraph() {
+	// Cull the passes that don't contribute to anything. Going backwards, a pass is needed if
+	// it writes to a persistent target or to a target that a needed pass reads from.
+	std::vector<bool> needed(renderPasses.size(), false);
+	for (int i = (int)renderPasses.size() - 1; i >= 0; --i) {
+		if (renderPasses[i].outputs.empty())
+			needed[i] = true;
+		for (RenderTarget target : renderPasses[i].outputs) {
+			if (renderTargets[target].persistent || renderTargets[target].used)
+				needed[i] = true;
+		}
+		if (!needed[i])
+			continue;
+		for (RenderTarget target : renderPasses[i].inputs)
+			renderTargets[target].used = true;
+		for (RenderTarget target : renderPasses[i].outputs)
+			renderTargets[target].used = true;
+	}
+
+	// Find out when each target is used for the last time, so that its texture can go back to the pool.
+	for (size_t i = 0; i < renderPasses.size(); ++i) {
+		if (!needed[i])
+			continue;
+		for (RenderTarget target : renderPasses[i].inputs)
+			renderTargets[target].lastUse = (int)i;
+		for (RenderTarget target : renderPasses[i].outputs)
+			renderTargets[target].lastUse = (int)i;
+	}
+
+	passTimings.clear();
+	uint query = renderGraphFrame % numTimerQueries;
+	for (size_t i = 0; i < renderPasses.size(); ++i) {
+		if (!needed[i])
+			continue;
+		RenderPassInfo &pass = renderPasses[i];
+		for (RenderTarget target : pass.outputs) {
+			RenderTargetInfo &info = renderTargets[target];
+			if (info.transient && !info.texture)
+				info.texture = acquirePooledTexture(info.width, info.height, info.format);
+		}
+
+		// Read the result of the oldest timer query of this pass before reusing it.
+		PassTimer &timer = passTimers[pass.name];
+		if (!timer.queries[0])
+			glGenQueries(numTimerQueries, timer.queries);
+		if (timer.pending[query]) {
+			GLuint64 gpuTime;
+			glGetQueryObjectui64v(timer.queries[query], GL_QUERY_RESULT, &gpuTime);
+			timer.gpuTime = (double)gpuTime / 1000000.0;
+			timer.pending[query] = false;
+		}
+
+		auto cpuStart = std::chrono::steady_clock::now();
+		glBeginQuery(GL_TIME_ELAPSED, timer.queries[query]);
+		if (!pass.outputs.empty()) {
+			glBindFramebuffer(GL_FRAMEBUFFER, getRenderFramebuffer(pass.outputs));
+			glViewport(0, 0, (GLsizei)renderTargets[pass.outputs[0]].width, (GLsizei)renderTargets[pass.outputs[0]].height);
+		}
+		pass.execute();
+		glEndQuery(GL_TIME_ELAPSED);
+		timer.pending[query] = true;
+		auto cpuEnd = std::chrono::steady_clock::now();
+
+		RenderPassTiming timing = { pass.name, std::chrono::duration<double, std::milli>(cpuEnd - cpuStart).count(), timer.gpuTime };
+		passTimings.push_back(timing);
+
+		for (RenderTarget target : pass.inputs) {
+			if (renderTargets[target].transient && renderTargets[target].lastUse == (int)i)
+				releasePooledTexture(renderTargets[target].texture);
+		}
+		for (RenderTarget target : pass.outputs) {
+			if (renderTargets[target].transient && renderTargets[target].lastUse == (int)i)
+				releasePooledTexture(renderTargets[target].texture);
+		}
+	}
+	glCheckErrors();
+
+	renderTargets.clear();
+	renderPasses.clear();
+	++renderGraphFrame;
+}
+const std::vector<RenderPassTiming> &getRenderPassTimings() {
+	return passTimings;
+}
+void destroyRenderGraph() {
+	for (PooledTexture &pooled : renderTargetPool)
+		destroyTexture(pooled.texture);
+	for (auto it = renderFramebuffers.begin(); it != renderFramebuffers.end(); ++it)
+		glDeleteFramebuffers(1, &it->second);
+	for (auto it = passTimers.begin(); it != passTimers.end(); ++it)
+		glDeleteQueries(numTimerQueries, it->second.queries);
+	renderTargetPool.clear();
+	renderFramebuffers.clear();
+	passTimers.clear();
+	renderTargets.clear();
+	renderPasses.clear();
+	glCheckErrors();
 }
\ No newline at end of file
@@ -5,6 +5,7 @@
 #include "glad.h"
 #include <stdio.h>
 #include <vector>
+#include <functional>
 
 #ifndef NDEBUG
 // Helper function-macro that calls glGetError and checks the result.
@@ -61,6 +62,8 @@ GpuBuffer createGpuBuffer(void *data, size_t size);
 void recreateGpuBuffer(GpuBuffer buffer, const void *data, size_t size);
 // glBufferSubData
 void updateGpuBuffer(GpuBuffer buffer, size_t offset, const void *data, size_t size);
+// glGetBufferSubData
+void readGpuBuffer(GpuBuffer buffer, size_t offset, void *data, size_t size);
 // glBindBuffer or glBindBufferBase depending on the slot and the binding
 void bindGpuBuffer(GpuBuffer buffer, BufferSlot slot, int binding);
 // glBindBufferRange
@@ -86,11 +89,20 @@ void destroyTextureArray(TextureArray tex);
 
 // Loads and compiles a shader program from the specified vertex and fragement shader.
 // If compile or link errors occur they are printed to stdout.
-Shader loadShader(const char *vertFile, const char *fragFile);
+//
+// Each of the 'defines' is injected into both shaders right after the #version line as
+// "#define <define>", so a define is either just a name like "NO_SHADOWS" or a name followed
+// by a value like "NUM_BOUNCES 2". Every compiled variant is cached by its files and defines,
+// so loading the same variant again just returns the already compiled program.
+Shader loadShader(const char *vertFile, const char *fragFile, const char *defines[] = NULL, uint numDefines = 0);
+// Loads and compiles a compute shader program, the same way as 'loadShader'.
+Shader loadComputeShader(const char *file, const char *defines[] = NULL, uint numDefines = 0);
 // glUseProgram
 void bindShader(Shader s);
-// glDeleteProgram
+// glDeleteProgram and remove the shader from the variant cache.
 void destroyShader(Shader s);
+// glDeleteProgram for every shader variant that was loaded.
+void destroyAllShaders();
 // Calls the appropriate glUniform* based on the 'type'.
 void setUniform(Shader s, uint location, ShaderDataType type, const void *value, size_t valueSize);
 
@@ -146,6 +158,46 @@ inline void setUniform(Shader s, uint location, uvec4 value) {
 	setUniform(s, location, GL_UNSIGNED_INT_VEC4, &value, sizeof(value));
 }
 
+// A render target in the render graph.
+typedef uint RenderTarget;
+
+// How long a render pass took on the CPU and on the GPU, in milliseconds.
+struct RenderPassTiming {
+	const char *name;
+	double cpuTime;
+	double gpuTime;
+};
+
+//
+// The render graph. Each frame is described as a list of render passes, where each pass declares
+// which render targets it reads and which it writes. When the graph is executed, the passes whose
+// outputs are never used are culled, the transient render targets are taken from a pool (targets
+// whose lifetimes don't overlap share the same texture), the output framebuffer of each pass is
+// bound for it, and each pass is timed on the CPU and GPU. The passes have to be added in the
+// order that they execute in, and each render target can only be written by a single pass.
+//
+
+// Declare a transient render target for this frame. Its texture is only valid inside of the passes that use it.
+RenderTarget createRenderTarget(const char *name, uint width, uint height, TextureStoreFormat format);
+// Import a texture that lives outside of the graph, like history that has to persist between frames.
+// Passes that write to imported render targets are never culled.
+RenderTarget importRenderTarget(const char *name, Texture tex, uint width, uint height);
+// Get the default framebuffer as a render target. Passes that write to it are never culled.
+RenderTarget getBackbuffer(uint width, uint height);
+// Add a render pass to the graph. Before 'execute' is called the outputs are bound as the color attachments
+// in order, except for depth formats which are bound as the depth attachment, and the viewport is set to the
+// size of the first output. Passes without any outputs, like compute passes that write to buffers, are never culled.
+void addRenderPass(const char *name, const std::vector<RenderTarget> &inputs, const std::vector<RenderTarget> &outputs, std::function<void()> execute);
+// Get the texture of a render target. Only valid while a pass that reads or writes the target is executing.
+Texture getRenderTexture(RenderTarget target);
+// Execute all of the render passes that were added this frame, and clear the graph for the next frame.
+void executeRenderGraph();
+// Get the timings of the passes that were executed last frame. The GPU timings are from a couple of
+// frames ago, since waiting for the latest ones would stall the CPU.
+const std::vector<RenderPassTiming> &getRenderPassTimings();
+// Destroy the pooled render targets, framebuffers and timer queries of the render graph.
+void destroyRenderGraph();
+
 // An array-list datastructure that is synchronized between the GPU and CPU.
 //
 // Its basically an std::vector that is backed by a GPU buffer. It keeps track
@@ -168,6 +220,7 @@ template <class T> struct GpuSyncedList {
 		dirtyBits.reserve(initialCapacity);
 		gpuBuffer = createGpuBuffer(NULL, items.capacity() * sizeof(T));
 		gpuBufferCapacity = items.capacity();
+		gpuBufferLength = 0;
 	}
 
 	// destroy the sync list and free all of it's memory.
@@ -207,6 +260,17 @@ template <class T> struct GpuSyncedList {
 		}
 	}
 
+	// Check if the list changed in any way since the last call to .bind().
+	bool isDirty() {
+		if (items.size() != gpuBufferLength || gpuBufferCapacity < items.capacity())
+			return true;
+		for (size_t i = 0; i < dirtyBits.size(); ++i) {
+			if (dirtyBits[i])
+				return true;
+		}
+		return false;
+	}
+
 	// Bind the GPU sync list to a GPU buffer slot.
 	void bind(BufferSlot slot, int binding) {
 		if (gpuBufferCapacity < items.capacity()) {
@@ -251,6 +315,7 @@ template <class T> struct GpuSyncedList {
 		//
 		// ----- Everything is synchronized beyond this point -----
 		//
+		gpuBufferLength = items.size();
 
 		if (items.size() > 0) {
 			// Apparently its an error to bind an empty range so we need to check for that..
@@ -288,6 +353,7 @@ template <class T> struct GpuSyncedList {
 private:
 	GpuBuffer gpuBuffer;
 	size_t gpuBufferCapacity;
+	size_t gpuBufferLength; // Number of items that were in the list when it was last bound.
 	std::vector<T> items;
 	std::vector<bool> dirtyBits;
 };
@@ -63,8 +63,7 @@ int main(int argc, char *argv[]) {
 	assert(window);
 	glfwMakeContextCurrent(window);
 
-	// Enable Vsync.
-	glfwSwapInterval(1);
+	// Vsync is set by the game from the config file.
 	// Hide the mouse cursor and steal mouse focus.
 	glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
 